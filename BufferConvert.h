@@ -0,0 +1,342 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <android/hardware/graphics/mapper/3.0/IMapper.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace hal {
+
+// Copy and conversion of locked buffer regions into client memory.
+//
+// YCbCr is converted to RGBA_8888 with the BT.601 limited range matrix in
+// fixed point with 6 fractional bits, computed in 16-bit lanes.  Rows are converted 16 pixels at a time with NEON on
+// ARM and with SSE2 on x86, which every x86-64 host has; the remaining
+// pixels, and everything on other architectures, go through the scalar
+// reference.  Both give bit-identical results.
+//
+// The functions take kVectorize = false to force the scalar reference.
+
+#if defined(__ARM_NEON)
+constexpr const char* kBufferConvertIsa = "neon";
+#elif defined(__SSE2__)
+constexpr const char* kBufferConvertIsa = "sse2";
+#else
+constexpr const char* kBufferConvertIsa = "scalar";
+#endif
+
+namespace detail {
+
+// BT.601 limited range coefficients, scaled by 64; luma is scaled by 74.5,
+// applied as 74 plus a half, so that 235 still maps to 255
+constexpr int16_t kConvertY = 74;
+constexpr int16_t kConvertCrR = 102;
+constexpr int16_t kConvertCbG = 25;
+constexpr int16_t kConvertCrG = 52;
+constexpr int16_t kConvertCbB = 129;
+
+inline uint8_t clampToByte(int32_t value) {
+    return static_cast<uint8_t>(std::min(std::max(value, 0), 255));
+}
+
+inline void convertPixel(uint8_t y, uint8_t cb, uint8_t cr, uint8_t* dst) {
+    const int32_t c = kConvertY * (y - 16) + ((y - 16) >> 1) + 32;
+    const int32_t d = cb - 128;
+    const int32_t e = cr - 128;
+    dst[0] = clampToByte((c + kConvertCrR * e) >> 6);
+    dst[1] = clampToByte((c - kConvertCbG * d - kConvertCrG * e) >> 6);
+    dst[2] = clampToByte((c + kConvertCbB * d) >> 6);
+    dst[3] = 0xff;
+}
+
+// The vector kernels below convert 16 pixels, i.e. 8 chroma samples, at a
+// time.  The intermediate values fit in 16 bits except for blue, which
+// saturates only where the scalar result clamps to 255 anyway.
+
+#if defined(__ARM_NEON)
+
+inline void convert8(uint8x8_t y, uint8x8_t cb, uint8x8_t cr, uint8x8_t* outR, uint8x8_t* outG,
+                     uint8x8_t* outB) {
+    const int16x8_t luma = vreinterpretq_s16_u16(vsubl_u8(y, vdup_n_u8(16)));
+    const int16x8_t c = vaddq_s16(vaddq_s16(vmulq_n_s16(luma, kConvertY), vshrq_n_s16(luma, 1)),
+                                  vdupq_n_s16(32));
+    const int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(cb, vdup_n_u8(128)));
+    const int16x8_t e = vreinterpretq_s16_u16(vsubl_u8(cr, vdup_n_u8(128)));
+
+    *outR = vqshrun_n_s16(vqaddq_s16(c, vmulq_n_s16(e, kConvertCrR)), 6);
+    *outG = vqshrun_n_s16(
+        vqsubq_s16(vqsubq_s16(c, vmulq_n_s16(d, kConvertCbG)), vmulq_n_s16(e, kConvertCrG)), 6);
+    *outB = vqshrun_n_s16(vqaddq_s16(c, vmulq_n_s16(d, kConvertCbB)), 6);
+}
+
+inline void convert16(uint8x16_t y, uint8x8_t cb, uint8x8_t cr, uint8_t* dst) {
+    // every chroma sample covers two horizontally adjacent pixels
+    const uint8x8x2_t cbPairs = vzip_u8(cb, cb);
+    const uint8x8x2_t crPairs = vzip_u8(cr, cr);
+
+    uint8x8_t r[2], g[2], b[2];
+    convert8(vget_low_u8(y), cbPairs.val[0], crPairs.val[0], &r[0], &g[0], &b[0]);
+    convert8(vget_high_u8(y), cbPairs.val[1], crPairs.val[1], &r[1], &g[1], &b[1]);
+
+    uint8x16x4_t rgba;
+    rgba.val[0] = vcombine_u8(r[0], r[1]);
+    rgba.val[1] = vcombine_u8(g[0], g[1]);
+    rgba.val[2] = vcombine_u8(b[0], b[1]);
+    rgba.val[3] = vdupq_n_u8(0xff);
+    vst4q_u8(dst, rgba);
+}
+
+inline void convert16SemiPlanar(const uint8_t* y, const uint8_t* chroma, bool cbFirst,
+                                uint8_t* dst) {
+    const uint8x8x2_t pairs = vld2_u8(chroma);
+    convert16(vld1q_u8(y), pairs.val[cbFirst ? 0 : 1], pairs.val[cbFirst ? 1 : 0], dst);
+}
+
+inline void convert16Planar(const uint8_t* y, const uint8_t* cb, const uint8_t* cr,
+                            uint8_t* dst) {
+    convert16(vld1q_u8(y), vld1_u8(cb), vld1_u8(cr), dst);
+}
+
+inline void convert16Uyvy(const uint8_t* src, uint8_t* dst) {
+    // U Y0 V Y1 for each pair of pixels
+    const uint8x8x4_t uyvy = vld4_u8(src);
+    const uint8x8x2_t y = vzip_u8(uyvy.val[1], uyvy.val[3]);
+    convert16(vcombine_u8(y.val[0], y.val[1]), uyvy.val[0], uyvy.val[2], dst);
+}
+
+#elif defined(__SSE2__)
+
+// y, cb and cr hold 8 samples in 16-bit lanes; returns 16-bit results
+inline void convert8(__m128i y, __m128i cb, __m128i cr, __m128i* outR, __m128i* outG,
+                     __m128i* outB) {
+    const __m128i luma = _mm_sub_epi16(y, _mm_set1_epi16(16));
+    const __m128i c = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(luma, _mm_set1_epi16(kConvertY)),
+                                                  _mm_srai_epi16(luma, 1)),
+                                    _mm_set1_epi16(32));
+    const __m128i d = _mm_sub_epi16(cb, _mm_set1_epi16(128));
+    const __m128i e = _mm_sub_epi16(cr, _mm_set1_epi16(128));
+
+    *outR = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(e, _mm_set1_epi16(kConvertCrR))), 6);
+    *outG = _mm_srai_epi16(
+        _mm_subs_epi16(_mm_subs_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(kConvertCbG))),
+                       _mm_mullo_epi16(e, _mm_set1_epi16(kConvertCrG))),
+        6);
+    *outB = _mm_srai_epi16(_mm_adds_epi16(c, _mm_mullo_epi16(d, _mm_set1_epi16(kConvertCbB))), 6);
+}
+
+// y holds 16 samples in bytes, cb and cr 8 samples in 16-bit lanes
+inline void convert16(__m128i y, __m128i cb, __m128i cr, uint8_t* dst) {
+    const __m128i zero = _mm_setzero_si128();
+
+    // every chroma sample covers two horizontally adjacent pixels
+    __m128i r[2], g[2], b[2];
+    convert8(_mm_unpacklo_epi8(y, zero), _mm_unpacklo_epi16(cb, cb), _mm_unpacklo_epi16(cr, cr),
+             &r[0], &g[0], &b[0]);
+    convert8(_mm_unpackhi_epi8(y, zero), _mm_unpackhi_epi16(cb, cb), _mm_unpackhi_epi16(cr, cr),
+             &r[1], &g[1], &b[1]);
+
+    const __m128i red = _mm_packus_epi16(r[0], r[1]);
+    const __m128i green = _mm_packus_epi16(g[0], g[1]);
+    const __m128i blue = _mm_packus_epi16(b[0], b[1]);
+    const __m128i alpha = _mm_set1_epi8(-1);
+
+    const __m128i rgLow = _mm_unpacklo_epi8(red, green);
+    const __m128i rgHigh = _mm_unpackhi_epi8(red, green);
+    const __m128i baLow = _mm_unpacklo_epi8(blue, alpha);
+    const __m128i baHigh = _mm_unpackhi_epi8(blue, alpha);
+
+    __m128i* out = reinterpret_cast<__m128i*>(dst);
+    _mm_storeu_si128(out + 0, _mm_unpacklo_epi16(rgLow, baLow));
+    _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(rgLow, baLow));
+    _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(rgHigh, baHigh));
+    _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(rgHigh, baHigh));
+}
+
+inline void convert16SemiPlanar(const uint8_t* y, const uint8_t* chroma, bool cbFirst,
+                                uint8_t* dst) {
+    const __m128i pairs = _mm_loadu_si128(reinterpret_cast<const __m128i*>(chroma));
+    const __m128i first = _mm_and_si128(pairs, _mm_set1_epi16(0xff));
+    const __m128i second = _mm_srli_epi16(pairs, 8);
+    convert16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y)), cbFirst ? first : second,
+              cbFirst ? second : first, dst);
+}
+
+inline void convert16Planar(const uint8_t* y, const uint8_t* cb, const uint8_t* cr,
+                            uint8_t* dst) {
+    const __m128i zero = _mm_setzero_si128();
+    convert16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(y)),
+              _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(cb)), zero),
+              _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(cr)), zero),
+              dst);
+}
+
+inline void convert16Uyvy(const uint8_t* src, uint8_t* dst) {
+    // U Y0 V Y1 for each pair of pixels
+    const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + 16));
+    const __m128i byteMask = _mm_set1_epi16(0xff);
+
+    const __m128i y = _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8));
+    const __m128i chroma =
+        _mm_packus_epi16(_mm_and_si128(low, byteMask), _mm_and_si128(high, byteMask));
+    convert16(y, _mm_and_si128(chroma, byteMask), _mm_srli_epi16(chroma, 8), dst);
+}
+
+#endif
+
+// convert pixels [left, right) of a row; chroma sample i of the row is at
+// cb[i * chromaStep] and cr[i * chromaStep]
+template <bool kVectorize>
+void convertYCbCrRow(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, uint32_t chromaStep,
+                     uint32_t left, uint32_t right, uint8_t* dst) {
+    uint32_t x = left;
+
+    // the vector kernels start on a chroma sample
+    if ((x & 1) && x < right) {
+        convertPixel(y[x], cb[(x / 2) * chromaStep], cr[(x / 2) * chromaStep], dst);
+        dst += 4;
+        x++;
+    }
+
+#if defined(__ARM_NEON) || defined(__SSE2__)
+    if constexpr (kVectorize) {
+        if (chromaStep == 2 && (cr == cb + 1 || cb == cr + 1)) {
+            const uint8_t* chroma = std::min(cb, cr);
+            const bool cbFirst = cb < cr;
+            for (; x + 16 <= right; x += 16, dst += 64) {
+                convert16SemiPlanar(y + x, chroma + x, cbFirst, dst);
+            }
+        } else if (chromaStep == 1) {
+            for (; x + 16 <= right; x += 16, dst += 64) {
+                convert16Planar(y + x, cb + x / 2, cr + x / 2, dst);
+            }
+        }
+    }
+#endif
+
+    for (; x < right; x++, dst += 4) {
+        convertPixel(y[x], cb[(x / 2) * chromaStep], cr[(x / 2) * chromaStep], dst);
+    }
+}
+
+// convert pixels [left, right) of a UYVY row
+template <bool kVectorize>
+void convertUyvyRow(const uint8_t* src, uint32_t left, uint32_t right, uint8_t* dst) {
+    uint32_t x = left;
+
+    if ((x & 1) && x < right) {
+        const uint8_t* pair = src + (x - 1) * 2;
+        convertPixel(pair[3], pair[0], pair[2], dst);
+        dst += 4;
+        x++;
+    }
+
+#if defined(__ARM_NEON) || defined(__SSE2__)
+    if constexpr (kVectorize) {
+        for (; x + 16 <= right; x += 16, dst += 64) {
+            convert16Uyvy(src + x * 2, dst);
+        }
+    }
+#endif
+
+    for (; x < right; x++, dst += 4) {
+        const uint8_t* pair = src + (x & ~1u) * 2;
+        convertPixel(pair[(x & 1) ? 3 : 1], pair[0], pair[2], dst);
+    }
+}
+
+}  // namespace detail
+
+// Convert accessRegion of a 4:2:0 buffer locked with lockYCbCr to RGBA_8888.
+// dst receives accessRegion.width x accessRegion.height pixels, with rows
+// dstStride bytes apart.
+template <bool kVectorize = true>
+void convertYCbCrToRgba(const YCbCrLayout& layout, const IMapper::Rect& accessRegion, void* dst,
+                        uint32_t dstStride) {
+    const auto y = static_cast<const uint8_t*>(layout.y);
+    const auto cb = static_cast<const uint8_t*>(layout.cb);
+    const auto cr = static_cast<const uint8_t*>(layout.cr);
+    const uint32_t left = accessRegion.left;
+    const uint32_t right = left + accessRegion.width;
+
+    auto out = static_cast<uint8_t*>(dst);
+    for (int32_t row = accessRegion.top; row < accessRegion.top + accessRegion.height; row++) {
+        const size_t chromaOffset = static_cast<size_t>(row / 2) * layout.cStride;
+        detail::convertYCbCrRow<kVectorize>(y + static_cast<size_t>(row) * layout.yStride,
+                                            cb + chromaOffset, cr + chromaOffset,
+                                            layout.chromaStep, left, right, out);
+        out += dstStride;
+    }
+}
+
+// Convert accessRegion of a UYVY buffer locked at data, with rows
+// strideBytes apart, to RGBA_8888.  dst is laid out as above.
+template <bool kVectorize = true>
+void convertUyvyToRgba(const void* data, uint32_t strideBytes, const IMapper::Rect& accessRegion,
+                       void* dst, uint32_t dstStride) {
+    const uint32_t left = accessRegion.left;
+    const uint32_t right = left + accessRegion.width;
+
+    auto src = static_cast<const uint8_t*>(data) +
+               static_cast<size_t>(accessRegion.top) * strideBytes;
+    auto out = static_cast<uint8_t*>(dst);
+    for (int32_t row = 0; row < accessRegion.height; row++) {
+        detail::convertUyvyRow<kVectorize>(src, left, right, out);
+        src += strideBytes;
+        out += dstStride;
+    }
+}
+
+// copy accessRegion of a single-plane buffer locked at data as it is
+inline void copyRegion(const void* data, uint32_t strideBytes, uint32_t bytesPerPixel,
+                       const IMapper::Rect& accessRegion, void* dst, uint32_t dstStride) {
+    const size_t rowBytes = static_cast<size_t>(accessRegion.width) * bytesPerPixel;
+
+    auto src = static_cast<const uint8_t*>(data) +
+               static_cast<size_t>(accessRegion.top) * strideBytes +
+               static_cast<size_t>(accessRegion.left) * bytesPerPixel;
+    auto out = static_cast<uint8_t*>(dst);
+    for (int32_t row = 0; row < accessRegion.height; row++) {
+        memcpy(out, src, rowBytes);
+        src += strideBytes;
+        out += dstStride;
+    }
+}
+
+}  // namespace hal
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
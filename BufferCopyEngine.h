@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef LOG_TAG
+#warning "BufferCopyEngine.h included without LOG_TAG"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <android-base/unique_fd.h>
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace hal {
+
+// BufferCopyEngine copies large strided images, typically a whole locked
+// frame, on a small pool of worker threads.  The image is cut into tiles of
+// whole rows, or of cache line aligned row spans when rows are very long,
+// which are spread over per-worker queues; idle workers steal tiles from
+// the others.  Tiles are written with non-temporal stores where available,
+// as readback destinations are rarely read back by the CPU right away.
+//
+// The number of workers is ro.vendor.gralloc.mapper.readback_threads,
+// capped at the number of CPUs.  When no worker can be started, copies run
+// on the caller.
+class BufferCopyEngine {
+public:
+    // Runs once the copy is done, and takes over the completion eventfd of
+    // the copy.  It must signal the eventfd with signalCompletion, either
+    // right away or once the work it starts is done.
+    using Callback = std::function<void(base::unique_fd completionFd)>;
+
+    // the values the completion eventfd of a copy can be read as
+    static constexpr uint64_t kCompletionOk = 1;
+    static constexpr uint64_t kCompletionFailed = 2;
+
+    // images smaller than this are not worth waking the workers up for
+    static constexpr size_t kParallelThreshold = 256 << 10;
+
+    static BufferCopyEngine& getInstance() {
+        // like GrallocImportedBufferPool, leaked on purpose so that it stays
+        // valid during process termination
+        static BufferCopyEngine* singleton = new BufferCopyEngine;
+        return *singleton;
+    }
+
+    // Copy rows rows of rowBytes bytes from src to dst.  onComplete runs on
+    // the worker that finishes the last tile; without it, the returned
+    // eventfd is signaled right away as kCompletionOk.  It is a plain
+    // eventfd, not a sync_file, so it must never be used as a fence.
+    // Returns an invalid fd, without copying, when the eventfd cannot be
+    // created.
+    base::unique_fd copy(const void* src, size_t srcStride, void* dst, size_t dstStride,
+                         size_t rowBytes, uint32_t rows, Callback onComplete) {
+        base::unique_fd completionFd(eventfd(0, EFD_CLOEXEC));
+        if (completionFd < 0) {
+            ALOGE("failed to create copy completion eventfd: %s", strerror(errno));
+            return {};
+        }
+
+        auto job = new Job;
+        job->onComplete = std::move(onComplete);
+        job->completionFd.reset(dup(completionFd));
+        if (job->completionFd < 0) {
+            ALOGE("failed to dup copy completion eventfd: %s", strerror(errno));
+            delete job;
+            return {};
+        }
+
+        std::call_once(mStartFlag, [this]() { start(); });
+
+        std::vector<Tile> tiles = split(job, static_cast<const uint8_t*>(src), srcStride,
+                                        static_cast<uint8_t*>(dst), dstStride, rowBytes, rows);
+        job->remaining.store(tiles.size(), std::memory_order_relaxed);
+
+        const size_t workerCount = mWorkerCount.load(std::memory_order_relaxed);
+        if (!workerCount) {
+            // no workers, copy on the caller instead
+            for (const Tile& tile : tiles) {
+                runTile(tile);
+            }
+            return completionFd;
+        }
+
+        // count the tiles before queueing them, so that the count never
+        // drops below zero when a worker takes one right away
+        {
+            std::lock_guard<std::mutex> lock(mIdleMutex);
+            mPendingTiles += tiles.size();
+        }
+        for (size_t i = 0; i < tiles.size(); i++) {
+            Worker& worker = *mWorkers[i % workerCount];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            worker.tiles.push_back(tiles[i]);
+        }
+        mIdleCondition.notify_all();
+
+        return completionFd;
+    }
+
+    // make the completion eventfd of a copy readable, as kCompletionOk or
+    // kCompletionFailed
+    static void signalCompletion(const base::unique_fd& completionFd, bool ok) {
+        const uint64_t value = ok ? kCompletionOk : kCompletionFailed;
+        if (TEMP_FAILURE_RETRY(write(completionFd, &value, sizeof(value))) < 0) {
+            ALOGE("failed to signal copy completion: %s", strerror(errno));
+        }
+    }
+
+    // like memcpy, with non-temporal stores where available
+    static void copyNonTemporal(uint8_t* dst, const uint8_t* src, size_t size) {
+#if defined(__SSE2__)
+        const size_t head = std::min(size, -reinterpret_cast<uintptr_t>(dst) & 15);
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        size -= head;
+
+        for (; size >= 64; size -= 64, dst += 64, src += 64) {
+            const __m128i* in = reinterpret_cast<const __m128i*>(src);
+            __m128i* out = reinterpret_cast<__m128i*>(dst);
+            _mm_stream_si128(out + 0, _mm_loadu_si128(in + 0));
+            _mm_stream_si128(out + 1, _mm_loadu_si128(in + 1));
+            _mm_stream_si128(out + 2, _mm_loadu_si128(in + 2));
+            _mm_stream_si128(out + 3, _mm_loadu_si128(in + 3));
+        }
+#elif defined(__clang__) && defined(__aarch64__)
+        typedef uint8_t Vector __attribute__((vector_size(16), may_alias));
+
+        const size_t head = std::min(size, -reinterpret_cast<uintptr_t>(dst) & 15);
+        memcpy(dst, src, head);
+        dst += head;
+        src += head;
+        size -= head;
+
+        // pairs of these become STNP
+        for (; size >= 64; size -= 64, dst += 64, src += 64) {
+            for (size_t i = 0; i < 64; i += 16) {
+                Vector value;
+                memcpy(&value, src + i, sizeof(value));
+                __builtin_nontemporal_store(value, reinterpret_cast<Vector*>(dst + i));
+            }
+        }
+#endif
+        memcpy(dst, src, size);
+    }
+
+private:
+    // bytes per tile, a multiple of the cache line size
+    static constexpr size_t kTileBytes = 64 << 10;
+    static constexpr uint32_t kMaxWorkers = 8;
+
+    struct Job {
+        std::atomic<size_t> remaining{0};
+        Callback onComplete;
+        base::unique_fd completionFd;
+    };
+
+    struct Tile {
+        Job* job;
+        const uint8_t* src;
+        uint8_t* dst;
+        size_t srcStride;
+        size_t dstStride;
+        size_t bytes;
+        uint32_t rows;
+    };
+
+    struct Worker {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    static std::vector<Tile> split(Job* job, const uint8_t* src, size_t srcStride, uint8_t* dst,
+                                   size_t dstStride, size_t rowBytes, uint32_t rows) {
+        std::vector<Tile> tiles;
+        if (!rowBytes || !rows) {
+            tiles.push_back(Tile{job, src, dst, srcStride, dstStride, 0, 0});
+            return tiles;
+        }
+
+        if (rowBytes >= kTileBytes) {
+            // cut each row into spans that end on a cache line of dst
+            for (uint32_t row = 0; row < rows; row++) {
+                const uint8_t* rowSrc = src + row * srcStride;
+                uint8_t* rowDst = dst + row * dstStride;
+                size_t offset = 0;
+                while (offset < rowBytes) {
+                    const uintptr_t end =
+                        (reinterpret_cast<uintptr_t>(rowDst + offset) + kTileBytes) & ~uintptr_t(63);
+                    const size_t bytes = std::min<size_t>(
+                        end - reinterpret_cast<uintptr_t>(rowDst + offset), rowBytes - offset);
+                    tiles.push_back(Tile{job, rowSrc + offset, rowDst + offset, srcStride,
+                                         dstStride, bytes, 1});
+                    offset += bytes;
+                }
+            }
+            return tiles;
+        }
+
+        const uint32_t tileRows = std::max<uint32_t>(1, kTileBytes / rowBytes);
+        for (uint32_t row = 0; row < rows; row += tileRows) {
+            tiles.push_back(Tile{job, src + row * srcStride, dst + row * dstStride, srcStride,
+                                 dstStride, rowBytes, std::min(tileRows, rows - row)});
+        }
+        return tiles;
+    }
+
+    static void runTile(const Tile& tile) {
+        const uint8_t* src = tile.src;
+        uint8_t* dst = tile.dst;
+        for (uint32_t row = 0; row < tile.rows; row++) {
+            copyNonTemporal(dst, src, tile.bytes);
+            src += tile.srcStride;
+            dst += tile.dstStride;
+        }
+#if defined(__SSE2__)
+        // order the streaming stores before the completion below
+        _mm_sfence();
+#endif
+
+        Job* job = tile.job;
+        if (job->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            if (job->onComplete) {
+                job->onComplete(std::move(job->completionFd));
+            } else {
+                signalCompletion(job->completionFd, true);
+            }
+            delete job;
+        }
+    }
+
+    void start() {
+        const uint32_t cpus = std::max(1u, std::thread::hardware_concurrency());
+        const int32_t threads =
+            property_get_int32("ro.vendor.gralloc.mapper.readback_threads", 4);
+        const uint32_t count = std::min({cpus, kMaxWorkers, static_cast<uint32_t>(
+                                                                std::max(threads, 0))});
+
+        // the queues are all created before any worker runs, and only the
+        // ones of started workers are used
+        for (uint32_t i = 0; i < count; i++) {
+            mWorkers.emplace_back(new Worker);
+        }
+        for (uint32_t i = 0; i < count; i++) {
+            auto start = new ThreadStart{this, i};
+            pthread_t thread;
+            const int error =
+                pthread_create(&thread, nullptr, &BufferCopyEngine::threadMain, start);
+            if (error) {
+                ALOGE("failed to start copy worker: %s", strerror(error));
+                delete start;
+                break;
+            }
+            pthread_detach(thread);
+            mWorkerCount.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    struct ThreadStart {
+        BufferCopyEngine* engine;
+        size_t index;
+    };
+
+    static void* threadMain(void* arg) {
+        std::unique_ptr<ThreadStart> start(static_cast<ThreadStart*>(arg));
+        start->engine->threadLoop(start->index);
+        return nullptr;
+    }
+
+    // take a tile from the back of our queue, or steal one from the front
+    // of another
+    bool takeTile(size_t index, Tile* outTile) {
+        const size_t workerCount = mWorkerCount.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < workerCount; i++) {
+            Worker& worker = *mWorkers[(index + i) % workerCount];
+            std::lock_guard<std::mutex> lock(worker.mutex);
+            if (worker.tiles.empty()) {
+                continue;
+            }
+
+            if (i == 0) {
+                *outTile = worker.tiles.back();
+                worker.tiles.pop_back();
+            } else {
+                *outTile = worker.tiles.front();
+                worker.tiles.pop_front();
+            }
+            mPendingTiles--;
+            return true;
+        }
+        return false;
+    }
+
+    void threadLoop(size_t index) {
+        while (true) {
+            Tile tile;
+            if (takeTile(index, &tile)) {
+                runTile(tile);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(mIdleMutex);
+            mIdleCondition.wait(lock, [this]() { return mPendingTiles.load() > 0; });
+        }
+    }
+
+    std::once_flag mStartFlag;
+    // written before mStartFlag is set
+    std::vector<std::unique_ptr<Worker>> mWorkers;
+    // the number of workers started, which own the first queues of mWorkers
+    std::atomic<size_t> mWorkerCount{0};
+
+    std::mutex mIdleMutex;
+    std::condition_variable mIdleCondition;
+    // tiles queued on any worker
+    std::atomic<size_t> mPendingTiles{0};
+};
+
+}  // namespace hal
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
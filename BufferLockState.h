@@ -0,0 +1,203 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef LOG_TAG
+#warning "BufferLockState.h included without LOG_TAG"
+#endif
+
+#include <mutex>
+
+#include <android/hardware/graphics/mapper/3.0/IMapper.h>
+#include <log/log.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace hal {
+
+using common::V1_2::BufferUsage;
+
+// BufferLockState tracks the CPU locks of one imported buffer.  A buffer is
+// either locked by any number of readers, or by a single writer.  Readers
+// whose region lies within a live vendor mapping share that mapping instead
+// of locking the buffer through the vendor module again.
+//
+// Every lock is bracketed by beginLock and, when it had to go through the
+// vendor module, endLock.  Every unlock starts with beginUnlock, which tells
+// whether the vendor module must be unlocked as well, and whether through
+// the mapping cache of the HAL or through the module itself: a buffer may
+// hold locks of both kinds at once, and each must be released the way it
+// was taken.
+class BufferLockState {
+public:
+    enum class Mapping : uint8_t {
+        DATA,
+        YCBCR,
+    };
+
+    // Reserve a lock of the buffer.  On success, *outShared tells whether
+    // the lock is served from the live mapping returned in *outData or
+    // *outLayout, or whether the caller must lock the vendor module and
+    // call endLock afterwards.
+    Error beginLock(uint64_t cpuUsage, const IMapper::Rect& accessRegion, Mapping mapping,
+                    bool mayShare, void** outData, YCbCrLayout* outLayout, bool* outShared) {
+        const bool write = cpuUsage & BufferUsage::CPU_WRITE_MASK;
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mWriter || (write && mReaders)) {
+            ALOGE("buffer is already locked for %s", mWriter ? "writing" : "reading");
+            return Error::BAD_BUFFER;
+        }
+
+        if (write) {
+            mWriter = true;
+        } else {
+            mReaders++;
+            if (mayShare && mMappingValid && mMapping == mapping &&
+                contains(mRegion, accessRegion)) {
+                *outData = mData;
+                *outLayout = mLayout;
+                *outShared = true;
+                return Error::NONE;
+            }
+        }
+
+        mVendorLocks++;
+        *outShared = false;
+        return Error::NONE;
+    }
+
+    // Complete a lock reserved by beginLock that went through the vendor.
+    // cached tells whether it was served by the mapping cache of the HAL.
+    void endLock(uint64_t cpuUsage, const IMapper::Rect& accessRegion, Mapping mapping,
+                 Error error, void* data, const YCbCrLayout& layout, bool cached) {
+        const bool write = cpuUsage & BufferUsage::CPU_WRITE_MASK;
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (error != Error::NONE) {
+            mVendorLocks--;
+            if (write) {
+                mWriter = false;
+            } else {
+                mReaders--;
+            }
+            return;
+        }
+
+        if (cached) {
+            mCachedLocks++;
+        }
+
+        // writers never share, and the first live mapping is kept for the
+        // readers to come
+        if (!write && !mMappingValid) {
+            mMappingValid = true;
+            mMapping = mapping;
+            mMappingCached = cached;
+            mRegion = accessRegion;
+            mData = data;
+            mLayout = layout;
+        }
+    }
+
+    // Release a lock.  Fails when the buffer is not locked; otherwise
+    // *outVendorUnlock tells whether the vendor module must be unlocked, and
+    // *outCached whether that lock was served by the mapping cache.
+    Error beginUnlock(bool* outVendorUnlock, bool* outCached) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mWriter) {
+            mWriter = false;
+        } else if (mReaders) {
+            // shared readers go first, so that the mapping stays alive as
+            // long as possible
+            mReaders--;
+            if (mReaders >= mVendorLocks) {
+                *outVendorUnlock = false;
+                return Error::NONE;
+            }
+        } else {
+            ALOGE("buffer is not locked");
+            return Error::BAD_BUFFER;
+        }
+
+        // The locks left are not shared, so any of them may go.  Locks of
+        // the kind that backs the shared mapping go last.
+        const uint32_t uncachedLocks = mVendorLocks - mCachedLocks;
+        bool cached;
+        if (mCachedLocks && uncachedLocks) {
+            cached = !(mMappingValid && mMappingCached);
+        } else {
+            cached = mCachedLocks != 0;
+        }
+
+        mVendorLocks--;
+        if (cached) {
+            mCachedLocks--;
+        }
+        if (mMappingValid && (mMappingCached ? !mCachedLocks : mVendorLocks == mCachedLocks)) {
+            mMappingValid = false;
+        }
+        *outVendorUnlock = true;
+        *outCached = cached;
+        return Error::NONE;
+    }
+
+    // forget all locks, e.g. when the buffer slot is reused
+    void reset() {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mReaders = 0;
+        mWriter = false;
+        mVendorLocks = 0;
+        mCachedLocks = 0;
+        mMappingValid = false;
+    }
+
+private:
+    static bool contains(const IMapper::Rect& outer, const IMapper::Rect& inner) {
+        return inner.left >= outer.left && inner.top >= outer.top &&
+               inner.left + inner.width <= outer.left + outer.width &&
+               inner.top + inner.height <= outer.top + outer.height;
+    }
+
+    std::mutex mMutex;
+    uint32_t mReaders = 0;
+    bool mWriter = false;
+    // locks taken through the vendor module, including pending ones
+    uint32_t mVendorLocks = 0;
+    // those of mVendorLocks served by the mapping cache
+    uint32_t mCachedLocks = 0;
+
+    // the mapping shared with readers, and the region it was locked for
+    bool mMappingValid = false;
+    Mapping mMapping = Mapping::DATA;
+    bool mMappingCached = false;
+    IMapper::Rect mRegion = {};
+    void* mData = nullptr;
+    YCbCrLayout mLayout = {};
+};
+
+}  // namespace hal
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
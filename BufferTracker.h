@@ -0,0 +1,241 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <cutils/properties.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace hal {
+
+// what is known about an imported buffer, for leak hunting
+struct ImportedBufferInfo {
+    void* buffer = nullptr;
+    // the number of imports sharing the buffer, see GrallocImportCache
+    uint32_t imports = 0;
+    // steady clock time of the first import
+    int64_t importTimeNs = 0;
+    uint64_t size = 0;
+    int32_t format = 0;
+    uint64_t usage = 0;
+    // the first importer; with a passthrough HAL, pid is always our own
+    // process
+    pid_t pid = 0;
+    pid_t tid = 0;
+};
+
+struct ImportedBufferTotals {
+    uint64_t count = 0;
+    uint64_t bytes = 0;
+};
+
+struct ImportedBufferSnapshot {
+    ImportedBufferTotals total;
+    std::map<int32_t, ImportedBufferTotals> byFormat;
+    std::map<uint64_t, ImportedBufferTotals> byUsage;
+    // every live buffer, oldest first
+    std::vector<ImportedBufferInfo> buffers;
+};
+
+// BufferTracker keeps the ImportedBufferInfo of every live buffer, and the
+// number of buffers and bytes imported per format and per usage, so that
+// runaway imports can be told apart from a busy but steady process.  A
+// buffer imported several times is counted once, until its last import is
+// removed.
+//
+// Tracking takes a global lock on every import and free, so it is only
+// enabled by ro.vendor.gralloc.mapper.track_buffers.
+class BufferTracker {
+public:
+    void initFromProperties() {
+        mEnabled = property_get_bool("ro.vendor.gralloc.mapper.track_buffers", false);
+    }
+
+    bool isEnabled() const { return mEnabled; }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    // record an import of a buffer by the calling thread
+    void add(void* buffer, uint64_t size, int32_t format, uint64_t usage) {
+        if (!mEnabled) {
+            return;
+        }
+
+        ImportedBufferInfo info;
+        info.buffer = buffer;
+        info.imports = 1;
+        info.importTimeNs = now();
+        info.size = size;
+        info.format = format;
+        info.usage = usage;
+        info.pid = getpid();
+        info.tid = gettid();
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto result = mBuffers.emplace(buffer, info);
+        if (!result.second) {
+            result.first->second.imports++;
+            return;
+        }
+        account(info, 1);
+    }
+
+    // record the removal of an import of a buffer
+    void remove(void* buffer) {
+        if (!mEnabled) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mBuffers.find(buffer);
+        if (it == mBuffers.end() || --it->second.imports) {
+            return;
+        }
+
+        account(it->second, -1);
+        mBuffers.erase(it);
+    }
+
+    ImportedBufferSnapshot snapshot() const {
+        ImportedBufferSnapshot snapshot;
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            snapshot.total = mTotal;
+            snapshot.byFormat = mByFormat;
+            snapshot.byUsage = mByUsage;
+            snapshot.buffers.reserve(mBuffers.size());
+            for (const auto& entry : mBuffers) {
+                snapshot.buffers.push_back(entry.second);
+            }
+        }
+
+        std::sort(snapshot.buffers.begin(), snapshot.buffers.end(),
+                  [](const ImportedBufferInfo& a, const ImportedBufferInfo& b) {
+                      return a.importTimeNs < b.importTimeNs;
+                  });
+        return snapshot;
+    }
+
+    // the totals, and the maxBuffers buffers that have been alive longest
+    std::string dump(size_t maxBuffers) const {
+        if (!mEnabled) {
+            return "imported buffers: not tracked (ro.vendor.gralloc.mapper.track_buffers)\n";
+        }
+
+        const ImportedBufferSnapshot stats = snapshot();
+        const int64_t nowNs = now();
+
+        std::string result;
+        char line[160];
+        snprintf(line, sizeof(line), "imported bytes: %" PRIu64 " in %" PRIu64 " buffers\n",
+                 stats.total.bytes, stats.total.count);
+        result += line;
+
+        result += "by format:\n";
+        for (const auto& entry : stats.byFormat) {
+            snprintf(line, sizeof(line), "  0x%-10x %8" PRIu64 " buffers %12" PRIu64 " bytes\n",
+                     entry.first, entry.second.count, entry.second.bytes);
+            result += line;
+        }
+
+        result += "by usage:\n";
+        for (const auto& entry : stats.byUsage) {
+            snprintf(line, sizeof(line),
+                     "  0x%-10" PRIx64 " %8" PRIu64 " buffers %12" PRIu64 " bytes\n", entry.first,
+                     entry.second.count, entry.second.bytes);
+            result += line;
+        }
+
+        result += "oldest buffers:\n";
+        const size_t count = std::min(maxBuffers, stats.buffers.size());
+        for (size_t i = 0; i < count; i++) {
+            const ImportedBufferInfo& info = stats.buffers[i];
+            snprintf(line, sizeof(line),
+                     "  %p: format 0x%x, usage 0x%" PRIx64 ", %" PRIu64
+                     " bytes, %u imports, %" PRId64 " s old, pid %d tid %d\n",
+                     info.buffer, info.format, info.usage, info.size, info.imports,
+                     (nowNs - info.importTimeNs) / 1000000000, info.pid, info.tid);
+            result += line;
+        }
+
+        return result;
+    }
+
+private:
+    static void account(ImportedBufferTotals* totals, uint64_t size, int sign) {
+        if (sign > 0) {
+            totals->count++;
+            totals->bytes += size;
+        } else {
+            totals->count--;
+            totals->bytes -= size;
+        }
+    }
+
+    void account(const ImportedBufferInfo& info, int sign) {
+        account(&mTotal, info.size, sign);
+        account(&mByFormat[info.format], info.size, sign);
+        account(&mByUsage[info.usage], info.size, sign);
+
+        // keep the tables to the formats and usages still in use
+        if (sign < 0) {
+            if (!mByFormat[info.format].count) {
+                mByFormat.erase(info.format);
+            }
+            if (!mByUsage[info.usage].count) {
+                mByUsage.erase(info.usage);
+            }
+        }
+    }
+
+    bool mEnabled = false;
+
+    mutable std::mutex mMutex;
+    std::unordered_map<void*, ImportedBufferInfo> mBuffers;
+    ImportedBufferTotals mTotal;
+    std::map<int32_t, ImportedBufferTotals> mByFormat;
+    std::map<uint64_t, ImportedBufferTotals> mByUsage;
+};
+
+}  // namespace hal
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
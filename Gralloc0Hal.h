@@ -22,11 +22,22 @@
 
 #include <inttypes.h>
 
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
 #include <hardware/gralloc.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include "MapperHal.h"
 #include "GrallocBufferDescriptor.h"
-#include <sync/sync.h>
+#include "GrallocBufferMetadata.h"
+#include "GrallocFence.h"
+#include "GrallocFormatTable.h"
+#include "GrallocHandlePool.h"
+#include "GrallocImportCache.h"
+#include "GrallocMappingCache.h"
+#include "GrallocYCbCrLayout.h"
 
 namespace android {
 namespace hardware {
@@ -42,12 +53,18 @@ using common::V1_2::BufferUsage;
 
 constexpr uint32_t minorApiVersionMask = 0xff;
 
-// Gralloc0HalImpl implements V3_0::hal::MapperHal on top of gralloc0
+// Gralloc0HalImpl implements V3_0::hal::MapperHal on top of gralloc0.
+// kAsyncLock tells whether the module takes acquire fences and returns
+// release fences itself (lockAsync/unlockAsync); it is decided once when
+// the module is loaded.
+template <bool kAsyncLock>
 class Gralloc0HalImpl : public hal::MapperHal {
 public:
     bool initWithModule(const hw_module_t* module) {
         mModule = reinterpret_cast<const gralloc_module_t*>(module);
-        mMinor = module->module_api_version & minorApiVersionMask;
+        mMappingCache.initFromProperties();
+        mImportCache.initFromProperties();
+        mParallelImport = property_get_bool("ro.vendor.gralloc.mapper.parallel_import", false);
         return true;
     }
 
@@ -71,45 +88,96 @@ public:
                   description.usage & ~validUsageBits);
         }
 
-        *outDescriptor = grallocEncodeBufferDescriptor(description);
+        mDescriptorCache.encode(description, outDescriptor);
 
         return Error::NONE;
     }
 
     Error importBuffer(const native_handle_t* rawHandle,
                        native_handle_t** outBufferHandle) override {
-        native_handle_t* bufferHandle = native_handle_clone(rawHandle);
+        native_handle_t* bufferHandle = mHandlePool.clone(rawHandle);
         if (!bufferHandle) {
             return Error::NO_RESOURCES;
         }
 
+        // a buffer imported already only needs a handle of its own
+        GrallocImportCache::Key key;
+        const bool shareable = mImportCache.getKey(rawHandle, &key);
+        if (shareable && mImportCache.acquire(key, bufferHandle)) {
+            *outBufferHandle = bufferHandle;
+            return Error::NONE;
+        }
+
         if (mModule->registerBuffer(mModule, bufferHandle)) {
-            native_handle_close(bufferHandle);
-            native_handle_delete(bufferHandle);
+            mHandlePool.destroy(bufferHandle);
             return Error::BAD_BUFFER;
         }
 
+        if (shareable) {
+            mImportCache.insert(key, bufferHandle);
+        }
         *outBufferHandle = bufferHandle;
 
         return Error::NONE;
     }
 
     Error freeBuffer(native_handle_t* bufferHandle) override {
-        if (mModule->unregisterBuffer(mModule, bufferHandle)) {
+        native_handle_t* registeredHandle;
+        const bool lastImport = mImportCache.release(bufferHandle, &registeredHandle);
+        if (registeredHandle != bufferHandle) {
+            mHandlePool.destroy(bufferHandle);
+        }
+
+        // other imports still share the registered handle
+        if (!lastImport) {
+            return Error::NONE;
+        }
+
+        mMappingCache.release(registeredHandle);
+
+        if (mModule->unregisterBuffer(mModule, registeredHandle)) {
             return Error::BAD_BUFFER;
         }
 
-        native_handle_close(bufferHandle);
-        native_handle_delete(bufferHandle);
+        mHandlePool.destroy(registeredHandle);
         return Error::NONE;
     }
 
+    native_handle_t* getRegisteredHandle(native_handle_t* bufferHandle) override {
+        return mImportCache.getRegisteredHandle(bufferHandle);
+    }
+
+    // registering buffers from several threads is only safe when the
+    // module is known to allow it
+    bool canImportInParallel() const override { return mParallelImport; }
+
+    Error getBufferMetadata(const native_handle_t* bufferHandle,
+                            BufferMetadata* outMetadata) override {
+        grallocGetBufferMetadata(bufferHandle, outMetadata);
+        return Error::NONE;
+    }
+
+    // modules without lockAsync, and the mapping cache, wait for the fence
+    bool waitsForAcquireFence() const override {
+        return !kAsyncLock || mMappingCache.isEnabled();
+    }
+
+    void* lockCached(const native_handle_t* bufferHandle, uint64_t cpuUsage,
+                     const IMapper::Rect& accessRegion) override {
+        return mMappingCache.isEnabled() ? mMappingCache.lock(bufferHandle, cpuUsage, accessRegion)
+                                         : nullptr;
+    }
+
+    void unlockCached(const native_handle_t* bufferHandle) override {
+        mMappingCache.unlock(bufferHandle);
+    }
+
     Error lock(const native_handle_t* bufferHandle, uint64_t cpuUsage,
                const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
                void** outData) override {
         int result = 0;
         void* data = nullptr;
-        if (mMinor >= 3 && mModule->lockAsync) {
+        if constexpr (kAsyncLock) {
             result = mModule->lockAsync(mModule, bufferHandle, cpuUsage, accessRegion.left,
                                         accessRegion.top, accessRegion.width, accessRegion.height,
                                         &data, fenceFd.release());
@@ -129,12 +197,117 @@ public:
         return Error::NONE;
     }
 
-    Error lockYCbCr(const native_handle_t* bufferHandle, uint64_t cpuUsage,
-                    const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
-                    YCbCrLayout* outLayout) override {
+    void lockAsync(const native_handle_t* bufferHandle, uint64_t cpuUsage,
+                   const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
+                   std::function<void(Error error, void* data)> callback) override {
+        if constexpr (kAsyncLock) {
+            MapperHal::lockAsync(bufferHandle, cpuUsage, accessRegion, std::move(fenceFd),
+                                 std::move(callback));
+            return;
+        }
+
+        auto lockTask = [this, bufferHandle, cpuUsage, accessRegion, callback]() {
+            void* data = nullptr;
+            Error error = lock(bufferHandle, cpuUsage, accessRegion, base::unique_fd(), &data);
+            callback(error, data);
+        };
+
+        if (grallocIsFenceSignaled(fenceFd)) {
+            lockTask();
+            return;
+        }
+
+        // Park the lock on the fence waiter instead of blocking in sync_wait.
+        // The module lock and the callback of the client may block, so they
+        // run on a mapper worker rather than on the waiter thread, which
+        // would hold up every other pending fence.
+        GrallocFenceWaiter::getInstance().waitAsync(std::move(fenceFd), [lockTask]() {
+            if (!hal::MapperWorkerPool::getInstance().post(lockTask)) {
+                lockTask();
+            }
+        });
+    }
+
+    Error lockBatch(std::vector<hal::LockRequest>* requests,
+                    std::vector<void*>* outData) override {
+        if constexpr (kAsyncLock) {
+            return MapperHal::lockBatch(requests, outData);
+        }
+
+        // Wait for all acquire fences at once and lock each buffer as soon as
+        // its own fence signals, rather than waiting for the fences in order.
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::vector<size_t> ready;
+
+        const size_t count = requests->size();
+        for (size_t i = 0; i < count; i++) {
+            GrallocFenceWaiter::getInstance().waitAsync(
+                std::move((*requests)[i].fenceFd), [&mutex, &condition, &ready, i]() {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    ready.push_back(i);
+                    condition.notify_one();
+                });
+        }
+
+        outData->assign(count, nullptr);
+        std::vector<bool> locked(count, false);
+        Error firstError = Error::NONE;
+        for (size_t done = 0; done < count;) {
+            std::vector<size_t> indices;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                condition.wait(lock, [&ready]() { return !ready.empty(); });
+                indices.swap(ready);
+            }
+
+            for (size_t i : indices) {
+                done++;
+                if (firstError != Error::NONE) {
+                    continue;
+                }
+
+                const hal::LockRequest& request = (*requests)[i];
+                firstError = lock(request.bufferHandle, request.cpuUsage, request.accessRegion,
+                                  base::unique_fd(), &(*outData)[i]);
+                locked[i] = firstError == Error::NONE;
+            }
+        }
+
+        if (firstError != Error::NONE) {
+            for (size_t i = 0; i < count; i++) {
+                if (locked[i]) {
+                    base::unique_fd fenceFd;
+                    unlock((*requests)[i].bufferHandle, &fenceFd);
+                }
+            }
+        }
+
+        return firstError;
+    }
+
+    Error lockYCbCr(const native_handle_t* bufferHandle, const BufferMetadata& metadata,
+                    uint64_t cpuUsage, const IMapper::Rect& accessRegion,
+                    base::unique_fd fenceFd, YCbCrLayout* outLayout) override {
+        // describe the planes ourselves when the module cannot
+        if (!mModule->lock_ycbcr && !(kAsyncLock && mModule->lockAsync_ycbcr) &&
+            grallocGetYCbCrGeometry(metadata.format)) {
+            void* data = nullptr;
+            Error error = lock(bufferHandle, cpuUsage, accessRegion, std::move(fenceFd), &data);
+            if (error == Error::NONE && !grallocGetSoftwareYCbCrLayout(metadata, data, outLayout)) {
+                ALOGE("buffer of format 0x%x has no plane layout", metadata.format);
+                // nothing was accessed through the lock, so its release
+                // fence is not needed
+                base::unique_fd releaseFenceFd;
+                unlock(bufferHandle, &releaseFenceFd);
+                error = Error::BAD_BUFFER;
+            }
+            return error;
+        }
+
         int result = 0;
         android_ycbcr ycbcr = {};
-        if (mMinor >= 3 && mModule->lockAsync_ycbcr) {
+        if (kAsyncLock && mModule->lockAsync_ycbcr) {
             result = mModule->lockAsync_ycbcr(mModule, bufferHandle, cpuUsage, accessRegion.left,
                                               accessRegion.top, accessRegion.width,
                                               accessRegion.height, &ycbcr, fenceFd.release());
@@ -166,7 +339,7 @@ public:
     Error unlock(const native_handle_t* bufferHandle, base::unique_fd* outFenceFd) override {
         int result = 0;
         int fenceFd = -1;
-        if (mMinor >= 3 && mModule->unlockAsync) {
+        if constexpr (kAsyncLock) {
             result = mModule->unlockAsync(mModule, bufferHandle, &fenceFd);
         } else {
             result = mModule->unlock(mModule, bufferHandle);
@@ -208,11 +381,7 @@ public:
             return false;
         }
 
-        if (description.format & ~getSupportedFormatsMask()) {
-            return false;
-        }
-
-        return true;
+        return isFormatSupported(static_cast<int32_t>(description.format));
     }
 
 protected:
@@ -228,34 +397,34 @@ protected:
                BufferUsage::HW_IMAGE_ENCODER;
     }
 
-    virtual int getSupportedFormatsMask() const {
-        return HAL_PIXEL_FORMAT_BGRX_8888 | HAL_PIXEL_FORMAT_BGRA_8888 |
-               HAL_PIXEL_FORMAT_RGB_888 | HAL_PIXEL_FORMAT_RGB_565 |
-               HAL_PIXEL_FORMAT_UYVY | HAL_PIXEL_FORMAT_NV12 |
-               HAL_PIXEL_FORMAT_NV12_CUSTOM | HAL_PIXEL_FORMAT_NV21 |
-               HAL_PIXEL_FORMAT_NV21_CUSTOM | HAL_PIXEL_FORMAT_YV12;
+    virtual bool isFormatSupported(int32_t format) const {
+        return grallocIsFormatSupported(format, GrallocFormatInfo::kGralloc0);
     }
 
     static void waitFenceFd(const base::unique_fd& fenceFd, const char* logname) {
-        if (fenceFd < 0) {
-            return;
-        }
-
-        const int warningTimeout = 3500;
-        const int error = sync_wait(fenceFd, warningTimeout);
-        if (error < 0 && errno == ETIME) {
-            ALOGE("%s: fence %d didn't signal in %u ms", logname, fenceFd.get(), warningTimeout);
-            sync_wait(fenceFd, -1);
-        }
+        grallocWaitFenceFd(fenceFd, logname);
     }
 
     const gralloc_module_t* mModule = nullptr;
-    uint8_t mMinor = 0;
+    bool mParallelImport = false;
+    GrallocMappingCache mMappingCache;
+    GrallocImportCache mImportCache;
+    GrallocHandlePool mHandlePool;
+    GrallocDescriptorCache mDescriptorCache;
 };
 
 }  // namespace detail
 
-using Gralloc0Hal = detail::Gralloc0HalImpl;
+// whether a gralloc0 module can be driven by Gralloc0AsyncHal
+inline bool gralloc0HasAsyncLock(const hw_module_t* module) {
+    auto grallocModule = reinterpret_cast<const gralloc_module_t*>(module);
+    return (module->module_api_version & detail::minorApiVersionMask) >= 3 &&
+           grallocModule->lockAsync && grallocModule->unlockAsync;
+}
+
+class Gralloc0SyncHal final : public detail::Gralloc0HalImpl<false> {};
+
+class Gralloc0AsyncHal final : public detail::Gralloc0HalImpl<true> {};
 
 }  // namespace passthrough
 }  // namespace renesas
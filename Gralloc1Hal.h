@@ -22,13 +22,22 @@
 
 #include <inttypes.h>
 
+#include <memory>
 #include <vector>
-#include <unordered_set>
 
 #include <hardware/gralloc1.h>
+#include <cutils/properties.h>
 #include <log/log.h>
 #include "MapperHal.h"
 #include "GrallocBufferDescriptor.h"
+#include "GrallocBufferMetadata.h"
+#include "GrallocFence.h"
+#include "GrallocFormatTable.h"
+#include "GrallocHandlePool.h"
+#include "GrallocImportCache.h"
+#include "GrallocMappingCache.h"
+#include "GrallocYCbCrLayout.h"
+#include "MapperStats.h"
 
 namespace android {
 namespace hardware {
@@ -60,6 +69,9 @@ public:
         }
 
         initCapabilities();
+        mMappingCache.initFromProperties();
+        mImportCache.initFromProperties();
+        mParallelImport = property_get_bool("ro.vendor.gralloc.mapper.parallel_import", false);
 
         if (!initDispatch()) {
             gralloc1_close(mDevice);
@@ -90,39 +102,112 @@ public:
                   description.usage & ~validUsageBits);
         }
 
-        *outDescriptor = grallocEncodeBufferDescriptor(description);
+        mDescriptorCache.encode(description, outDescriptor);
 
         return Error::NONE;
     }
 
     Error importBuffer(const native_handle_t* rawHandle,
                        native_handle_t** outBufferHandle) override {
-        native_handle_t* bufferHandle = native_handle_clone(rawHandle);
+        // a buffer imported already only needs a handle of its own, which
+        // is never handed to the module
+        native_handle_t* bufferHandle = nullptr;
+        GrallocImportCache::Key key;
+        const bool shareable = mImportCache.getKey(rawHandle, &key);
+        if (shareable) {
+            bufferHandle = mHandlePool.clone(rawHandle);
+            if (!bufferHandle) {
+                return Error::NO_RESOURCES;
+            }
+            if (mImportCache.acquire(key, bufferHandle)) {
+                *outBufferHandle = bufferHandle;
+                return Error::NONE;
+            }
+            if (mCapabilities.releaseImplyDelete) {
+                mHandlePool.destroy(bufferHandle);
+                bufferHandle = nullptr;
+            }
+        }
+
+        // the module deletes released handles itself when it implies
+        // delete, so they must come from native_handle_clone then
+        if (!bufferHandle) {
+            bufferHandle = mCapabilities.releaseImplyDelete ? native_handle_clone(rawHandle)
+                                                            : mHandlePool.clone(rawHandle);
+        }
         if (!bufferHandle) {
             return Error::NO_RESOURCES;
         }
 
         int32_t error = mDispatch.retain(mDevice, bufferHandle);
         if (error != GRALLOC1_ERROR_NONE) {
-            native_handle_close(bufferHandle);
-            native_handle_delete(bufferHandle);
+            if (mCapabilities.releaseImplyDelete) {
+                native_handle_close(bufferHandle);
+                native_handle_delete(bufferHandle);
+            } else {
+                mHandlePool.destroy(bufferHandle);
+            }
             return toError(error);
         }
 
+        if (shareable) {
+            mImportCache.insert(key, bufferHandle);
+        }
         *outBufferHandle = bufferHandle;
 
         return Error::NONE;
     }
 
     Error freeBuffer(native_handle_t* bufferHandle) override {
-        int32_t error = mDispatch.release(mDevice, bufferHandle);
+        native_handle_t* registeredHandle;
+        const bool lastImport = mImportCache.release(bufferHandle, &registeredHandle);
+        if (registeredHandle != bufferHandle) {
+            mHandlePool.destroy(bufferHandle);
+        }
+
+        // other imports still share the registered handle
+        if (!lastImport) {
+            return Error::NONE;
+        }
+
+        mMappingCache.release(registeredHandle);
+
+        int32_t error = mDispatch.release(mDevice, registeredHandle);
         if (error == GRALLOC1_ERROR_NONE && !mCapabilities.releaseImplyDelete) {
-            native_handle_close(bufferHandle);
-            native_handle_delete(bufferHandle);
+            mHandlePool.destroy(registeredHandle);
         }
         return toError(error);
     }
 
+    native_handle_t* getRegisteredHandle(native_handle_t* bufferHandle) override {
+        return mImportCache.getRegisteredHandle(bufferHandle);
+    }
+
+    // registering buffers from several threads is only safe when the
+    // module is known to allow it
+    bool canImportInParallel() const override { return mParallelImport; }
+
+    Error getBufferMetadata(const native_handle_t* bufferHandle,
+                            BufferMetadata* outMetadata) override {
+        grallocGetBufferMetadata(bufferHandle, outMetadata);
+
+        // The flex plane count is only meaningful for YCbCr buffers.  When
+        // the module cannot tell it, the count is recorded as 0 rather than
+        // taken from the format table, and lockYCbCr rejects the buffer.
+        if (outMetadata->formatClass != BufferMetadata::FormatClass::RGB) {
+            uint32_t numPlanes = 0;
+            int32_t error = mDispatch.getNumFlexPlanes(mDevice, bufferHandle, &numPlanes);
+            if (error != GRALLOC1_ERROR_NONE) {
+                ALOGW("failed to get the flex plane count of buffer %p: %d", bufferHandle,
+                      error);
+                numPlanes = 0;
+            }
+            outMetadata->numPlanes = numPlanes;
+        }
+
+        return Error::NONE;
+    }
+
     Error validateBufferSize(const native_handle_t* bufferHandle,
                              const IMapper::BufferDescriptorInfo& description,
                              uint32_t stride) override {
@@ -150,6 +235,19 @@ public:
         return toError(error);
     }
 
+    // the module takes the fence over unless the mapping cache is used
+    bool waitsForAcquireFence() const override { return mMappingCache.isEnabled(); }
+
+    void* lockCached(const native_handle_t* bufferHandle, uint64_t cpuUsage,
+                     const IMapper::Rect& accessRegion) override {
+        return mMappingCache.isEnabled() ? mMappingCache.lock(bufferHandle, cpuUsage, accessRegion)
+                                         : nullptr;
+    }
+
+    void unlockCached(const native_handle_t* bufferHandle) override {
+        mMappingCache.unlock(bufferHandle);
+    }
+
     Error lock(const native_handle_t* bufferHandle, uint64_t cpuUsage,
                const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
                void** outData) override {
@@ -166,17 +264,27 @@ public:
         return toError(error);
     }
 
-    Error lockYCbCr(const native_handle_t* bufferHandle, uint64_t cpuUsage,
-                    const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
-                    YCbCrLayout* outLayout) override {
+    Error lockYCbCr(const native_handle_t* bufferHandle, const BufferMetadata& metadata,
+                    uint64_t cpuUsage, const IMapper::Rect& accessRegion,
+                    base::unique_fd fenceFd, YCbCrLayout* outLayout) override {
         // prepare flex layout
         android_flex_layout flex = {};
-        int32_t error = mDispatch.getNumFlexPlanes(mDevice, bufferHandle, &flex.num_planes);
-        if (error != GRALLOC1_ERROR_NONE) {
-            return toError(error);
+        int32_t error = GRALLOC1_ERROR_NONE;
+        flex.num_planes = metadata.numPlanes;
+        if (metadata.formatClass == BufferMetadata::FormatClass::RGB) {
+            // the plane count was not queried at import time
+            error = mDispatch.getNumFlexPlanes(mDevice, bufferHandle, &flex.num_planes);
+            if (error != GRALLOC1_ERROR_NONE) {
+                return lockYCbCrSoftware(bufferHandle, metadata, cpuUsage, accessRegion,
+                                         std::move(fenceFd), outLayout, toError(error));
+            }
         }
-        std::vector<android_flex_plane_t> flexPlanes(flex.num_planes);
-        flex.planes = flexPlanes.data();
+        if (!flex.num_planes) {
+            ALOGE("buffer of format 0x%x has no flex planes", metadata.format);
+            return Error::UNSUPPORTED;
+        }
+        FlexPlaneStorage flexPlanes;
+        flex.planes = flexPlanes.allocate(flex.num_planes);
 
         const uint64_t consumerUsage =
             cpuUsage & ~static_cast<uint64_t>(BufferUsage::CPU_WRITE_MASK);
@@ -185,9 +293,15 @@ public:
                                    &flex, fenceFd.release());
         if (error == GRALLOC1_ERROR_NONE && !toYCbCrLayout(flex, outLayout)) {
             ALOGD("unable to convert android_flex_layout to YCbCrLayout");
-            // undo the lock
-            unlock(bufferHandle, &fenceFd);
-            error = GRALLOC1_ERROR_BAD_HANDLE;
+            // undo the lock, which never goes through the mapping cache
+            int undoFenceFd = -1;
+            mDispatch.unlock(mDevice, bufferHandle, &undoFenceFd);
+            fenceFd.reset(undoFenceFd);
+
+            // the release fence of the undone lock is the acquire fence of
+            // the plain one
+            return lockYCbCrSoftware(bufferHandle, metadata, cpuUsage, accessRegion,
+                                     std::move(fenceFd), outLayout, Error::BAD_BUFFER);
         }
 
         return toError(error);
@@ -207,30 +321,31 @@ public:
             return false;
         }
 
-        const std::unordered_set<int32_t> supportedFormats = {
-            HAL_PIXEL_FORMAT_RGBA_8888,
-            HAL_PIXEL_FORMAT_RGBX_8888,
-            HAL_PIXEL_FORMAT_RGB_565,
-            HAL_PIXEL_FORMAT_BGRA_8888,
-            HAL_PIXEL_FORMAT_YCRCB_420_SP,
-            HAL_PIXEL_FORMAT_RGBA_FP16,
-            HAL_PIXEL_FORMAT_RAW16,
-            HAL_PIXEL_FORMAT_BLOB,
-            HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED,
-            HAL_PIXEL_FORMAT_YCBCR_420_888,
-            HAL_PIXEL_FORMAT_RAW10,
-            HAL_PIXEL_FORMAT_RAW12,
-            HAL_PIXEL_FORMAT_UYVY,
-            HAL_PIXEL_FORMAT_RGBA_1010102,
-            HAL_PIXEL_FORMAT_YV12
-        };
-
-        const int32_t format = static_cast<int32_t>(description.format);
-
-		return !!supportedFormats.count(format);
+        return isFormatSupported(static_cast<int32_t>(description.format));
     }
 
 protected:
+    // Plane storage for android_flex_layout.  Every format we ship has at
+    // most kInlinePlanes planes, so lockYCbCr normally does not allocate.
+    class FlexPlaneStorage {
+    public:
+        static constexpr uint32_t kInlinePlanes = 4;
+
+        android_flex_plane_t* allocate(uint32_t numPlanes) {
+            if (numPlanes <= kInlinePlanes) {
+                return mInlinePlanes;
+            }
+
+            MapperStats::add(MapperStats::Counter::FLEX_PLANE_HEAP_ALLOCATIONS, 1);
+            mHeapPlanes.reset(new android_flex_plane_t[numPlanes]());
+            return mHeapPlanes.get();
+        }
+
+    private:
+        android_flex_plane_t mInlinePlanes[kInlinePlanes] = {};
+        std::unique_ptr<android_flex_plane_t[]> mHeapPlanes;
+    };
+
     virtual void initCapabilities() {
         uint32_t count = 0;
         mDevice->getCapabilities(mDevice, &count, nullptr);
@@ -290,12 +405,8 @@ protected:
                BufferUsage::HW_IMAGE_ENCODER;
     }
 
-    virtual int getSupportedFormatsMask() const {
-        return HAL_PIXEL_FORMAT_BGRX_8888 | HAL_PIXEL_FORMAT_BGRA_8888 |
-               HAL_PIXEL_FORMAT_RGB_888 | HAL_PIXEL_FORMAT_RGB_565 |
-               HAL_PIXEL_FORMAT_UYVY | HAL_PIXEL_FORMAT_NV12 |
-               HAL_PIXEL_FORMAT_NV12_CUSTOM | HAL_PIXEL_FORMAT_NV21 |
-               HAL_PIXEL_FORMAT_NV21_CUSTOM | HAL_PIXEL_FORMAT_YV12;
+    virtual bool isFormatSupported(int32_t format) const {
+        return grallocIsFormatSupported(format, GrallocFormatInfo::kGralloc1);
     }
 
     static Error toError(int32_t error) {
@@ -319,6 +430,29 @@ protected:
         }
     }
 
+    // Lock the buffer with a plain lock and describe its planes ourselves,
+    // for the formats we know the layout of.  Other formats fail with
+    // error.
+    Error lockYCbCrSoftware(const native_handle_t* bufferHandle, const BufferMetadata& metadata,
+                            uint64_t cpuUsage, const IMapper::Rect& accessRegion,
+                            base::unique_fd fenceFd, YCbCrLayout* outLayout, Error error) {
+        if (!grallocGetYCbCrGeometry(metadata.format)) {
+            return error;
+        }
+
+        void* data = nullptr;
+        error = lock(bufferHandle, cpuUsage, accessRegion, std::move(fenceFd), &data);
+        if (error == Error::NONE && !grallocGetSoftwareYCbCrLayout(metadata, data, outLayout)) {
+            ALOGE("buffer of format 0x%x has no plane layout", metadata.format);
+            // nothing was accessed through the lock, so its release fence
+            // is not needed
+            base::unique_fd releaseFenceFd;
+            unlock(bufferHandle, &releaseFenceFd);
+            error = Error::BAD_BUFFER;
+        }
+        return error;
+    }
+
     static bool toYCbCrLayout(const android_flex_layout& flex, YCbCrLayout* outLayout) {
         // must be YCbCr
         if (flex.format != FLEX_FORMAT_YCbCr || flex.num_planes < 3) {
@@ -457,11 +591,17 @@ protected:
         GRALLOC1_PFN_VALIDATE_BUFFER_SIZE validateBufferSize;
         GRALLOC1_PFN_GET_TRANSPORT_SIZE getTransportSize;
     } mDispatch = {};
+
+    bool mParallelImport = false;
+    GrallocMappingCache mMappingCache;
+    GrallocImportCache mImportCache;
+    GrallocHandlePool mHandlePool;
+    GrallocDescriptorCache mDescriptorCache;
 };
 
 }  // namespace detail
 
-using Gralloc1Hal = detail::Gralloc1HalImpl;
+class Gralloc1Hal final : public detail::Gralloc1HalImpl {};
 
 }  // namespace passthrough
 }  // namespace renesas
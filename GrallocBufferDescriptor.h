@@ -16,6 +16,10 @@
 
 #pragma once
 
+#include <array>
+#include <atomic>
+#include <mutex>
+
 #include <android/hardware/graphics/mapper/3.0/IMapper.h>
 
 namespace android {
@@ -35,17 +39,22 @@ using android::hardware::graphics::common::V1_2::PixelFormat;
 constexpr uint32_t grallocBufferDescriptorSize = 7;
 constexpr uint32_t grallocBufferDescriptorMagicVersion = ((0x9487 << 16) | 0);
 
+inline void grallocEncodeBufferDescriptor(const IMapper::BufferDescriptorInfo& description,
+                                          uint32_t* outWords) {
+    outWords[0] = grallocBufferDescriptorMagicVersion;
+    outWords[1] = description.width;
+    outWords[2] = description.height;
+    outWords[3] = description.layerCount;
+    outWords[4] = static_cast<uint32_t>(description.format);
+    outWords[5] = static_cast<uint32_t>(description.usage);
+    outWords[6] = static_cast<uint32_t>(description.usage >> 32);
+}
+
 inline BufferDescriptor grallocEncodeBufferDescriptor(
     const IMapper::BufferDescriptorInfo& description) {
     BufferDescriptor descriptor;
     descriptor.resize(grallocBufferDescriptorSize);
-    descriptor[0] = grallocBufferDescriptorMagicVersion;
-    descriptor[1] = description.width;
-    descriptor[2] = description.height;
-    descriptor[3] = description.layerCount;
-    descriptor[4] = static_cast<uint32_t>(description.format);
-    descriptor[5] = static_cast<uint32_t>(description.usage);
-    descriptor[6] = static_cast<uint32_t>(description.usage >> 32);
+    grallocEncodeBufferDescriptor(description, descriptor.data());
 
     return descriptor;
 }
@@ -68,6 +77,100 @@ inline bool grallocDecodeBufferDescriptor(const BufferDescriptor& descriptor,
     return true;
 }
 
+// GrallocDescriptorCache interns the encoded form of the descriptors
+// created so far.  Clients keep creating the same few descriptors, and
+// handing out an interned one makes createDescriptor allocation-free.
+// Interned descriptors are never freed or modified, so they can be shared
+// as external hidl_vec storage and looked up without locking.  They must
+// not be used after the cache is gone.
+class GrallocDescriptorCache {
+public:
+    GrallocDescriptorCache() = default;
+
+    ~GrallocDescriptorCache() {
+        for (auto& slot : mSlots) {
+            delete slot.load(std::memory_order_relaxed);
+        }
+    }
+
+    GrallocDescriptorCache(const GrallocDescriptorCache&) = delete;
+    GrallocDescriptorCache& operator=(const GrallocDescriptorCache&) = delete;
+
+    // like grallocEncodeBufferDescriptor
+    void encode(const IMapper::BufferDescriptorInfo& description,
+                BufferDescriptor* outDescriptor) {
+        Words words;
+        grallocEncodeBufferDescriptor(description, words.data());
+        const uint64_t hash = getHash(words);
+
+        const Entry* entry = find(words, hash);
+        if (!entry) {
+            entry = insert(words, hash);
+        }
+
+        if (entry) {
+            outDescriptor->setToExternal(const_cast<uint32_t*>(entry->words.data()),
+                                         entry->words.size(), false);
+        } else {
+            *outDescriptor = grallocEncodeBufferDescriptor(description);
+        }
+    }
+
+private:
+    static constexpr size_t kCapacity = 64;
+
+    using Words = std::array<uint32_t, grallocBufferDescriptorSize>;
+
+    struct Entry {
+        uint64_t hash;
+        Words words;
+    };
+
+    static uint64_t getHash(const Words& words) {
+        // FNV-1a
+        uint64_t hash = 0xcbf29ce484222325ull;
+        for (uint32_t word : words) {
+            hash = (hash ^ word) * 0x100000001b3ull;
+        }
+        return hash;
+    }
+
+    const Entry* find(const Words& words, uint64_t hash) const {
+        for (size_t i = 0; i < kCapacity; i++) {
+            const Entry* entry = mSlots[(hash + i) % kCapacity].load(std::memory_order_acquire);
+            if (!entry) {
+                return nullptr;
+            }
+            if (entry->hash == hash && entry->words == words) {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // returns nullptr once the cache is full
+    const Entry* insert(const Words& words, uint64_t hash) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (size_t i = 0; i < kCapacity; i++) {
+            std::atomic<const Entry*>& slot = mSlots[(hash + i) % kCapacity];
+            const Entry* entry = slot.load(std::memory_order_relaxed);
+            if (!entry) {
+                entry = new Entry{hash, words};
+                slot.store(entry, std::memory_order_release);
+                return entry;
+            }
+            if (entry->hash == hash && entry->words == words) {
+                return entry;
+            }
+        }
+        return nullptr;
+    }
+
+    // protects insertions only
+    std::mutex mMutex;
+    std::array<std::atomic<const Entry*>, kCapacity> mSlots = {};
+};
+
 }  // namespace passthrough
 }  // namespace renesas
 }  // namespace V3_0
@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+
+#include <hardware/gralloc.h>
+#include "GrallocFormatTable.h"
+#include "MapperHal.h"
+#include "../hwcomposer/img_gralloc_common_public.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+using hal::BufferMetadata;
+
+// fill in the metadata that can be read directly from IMG_native_handle_t
+inline void grallocGetBufferMetadata(const native_handle_t* bufferHandle,
+                                     BufferMetadata* outMetadata) {
+    const IMG_native_handle_t* imgHandle =
+        reinterpret_cast<const IMG_native_handle_t*>(bufferHandle);
+
+    BufferMetadata metadata;
+    metadata.format = imgHandle->iFormat;
+    const GrallocFormatInfo* formatInfo = grallocGetFormatInfo(metadata.format);
+    if (formatInfo) {
+        metadata.formatClass = formatInfo->formatClass;
+        metadata.numPlanes = formatInfo->numPlanes;
+    } else {
+        metadata.numPlanes = 1;
+    }
+    metadata.width = static_cast<uint32_t>(imgHandle->iWidth);
+    metadata.height = static_cast<uint32_t>(imgHandle->iHeight);
+    metadata.bitsPerPixel = imgHandle->uiBpp;
+    metadata.bytesPerPixel = imgHandle->uiBpp >> 3;
+
+    const uint32_t numStrides = std::min<uint32_t>(MAX_SUB_ALLOCS, BufferMetadata::kMaxPlanes);
+    for (uint32_t i = 0; i < numStrides; i++) {
+        metadata.planeStride[i] = static_cast<uint32_t>(imgHandle->aiStride[i]);
+        metadata.planeVStride[i] = static_cast<uint32_t>(std::max(imgHandle->aiVStride[i], 0));
+        metadata.planeOffset[i] = imgHandle->aulPlaneOffset[i];
+    }
+
+    *outMetadata = metadata;
+}
+
+// The size of the buffer as described by IMG_native_handle_t, i.e. its
+// first plane and the planes of the same stride that follow it.
+inline uint64_t grallocGetBufferSize(const native_handle_t* bufferHandle) {
+    const IMG_native_handle_t* imgHandle =
+        reinterpret_cast<const IMG_native_handle_t*>(bufferHandle);
+    return static_cast<uint64_t>(std::max(imgHandle->aiStride[0], 0)) *
+           std::max(imgHandle->iHeight, 0) * imgHandle->uiBpp / 8;
+}
+
+inline uint64_t grallocGetBufferUsage(const native_handle_t* bufferHandle) {
+    const IMG_native_handle_t* imgHandle =
+        reinterpret_cast<const IMG_native_handle_t*>(bufferHandle);
+    return static_cast<uint32_t>(imgHandle->usage);
+}
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
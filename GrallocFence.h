@@ -0,0 +1,223 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef LOG_TAG
+#warning "GrallocFence.h included without LOG_TAG"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/epoll.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
+
+#include <android-base/unique_fd.h>
+#include <log/log.h>
+#include <sync/sync.h>
+#include "MapperStats.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+// Block until the fence signals, complaining when it takes too long.
+// Returns false when the fence cannot be waited for.
+inline bool grallocWaitFenceFd(int fenceFd, const char* logname) {
+    if (fenceFd < 0) {
+        return true;
+    }
+
+    hal::MapperStats::ScopedTimer timer(hal::MapperStats::Op::FENCE_WAIT);
+
+    const int warningTimeout = 3500;
+    int error = sync_wait(fenceFd, warningTimeout);
+    if (error < 0 && errno == ETIME) {
+        ALOGE("%s: fence %d didn't signal in %u ms", logname, fenceFd, warningTimeout);
+        error = sync_wait(fenceFd, -1);
+    }
+    if (error < 0) {
+        ALOGE("%s: failed to wait for fence %d: %s", logname, fenceFd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// check whether a fence has signaled without blocking
+inline bool grallocIsFenceSignaled(int fenceFd) {
+    if (fenceFd < 0) {
+        return true;
+    }
+
+    struct pollfd fds = {fenceFd, POLLIN, 0};
+    int ret;
+    do {
+        ret = poll(&fds, 1, 0);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    return ret > 0 && (fds.revents & (POLLIN | POLLERR));
+}
+
+// GrallocFenceWaiter waits for any number of fences on a single epoll
+// thread and runs a callback as each of them signals.  It lets the mapper
+// park a lock until its acquire fence signals instead of blocking one
+// thread per pending fence in sync_wait.
+class GrallocFenceWaiter {
+public:
+    using Callback = std::function<void()>;
+
+    static GrallocFenceWaiter& getInstance() {
+        // like GrallocImportedBufferPool, leaked on purpose so that it stays
+        // valid during process termination
+        static GrallocFenceWaiter* singleton = new GrallocFenceWaiter;
+        return *singleton;
+    }
+
+    // Run callback once fenceFd signals.  The callback runs on the calling
+    // thread when the fence has already signaled, and on the waiter thread
+    // otherwise.  It must not block.
+    void waitAsync(base::unique_fd fenceFd, Callback callback) {
+        if (grallocIsFenceSignaled(fenceFd)) {
+            callback();
+            return;
+        }
+
+        std::call_once(mStartFlag, [this]() { start(); });
+
+        const int fd = fenceFd.get();
+        auto pending = std::make_unique<Pending>();
+        pending->fenceFd = std::move(fenceFd);
+        pending->callback = std::move(callback);
+        pending->startTime = std::chrono::steady_clock::now();
+
+        if (mEpollFd >= 0) {
+            std::lock_guard<std::mutex> lock(mMutex);
+
+            struct epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.ptr = pending.get();
+            if (!epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event)) {
+                mPending.insert(pending.release());
+                return;
+            }
+            ALOGE("failed to watch fence %d: %s", fd, strerror(errno));
+        }
+
+        // no waiter thread, block the caller instead
+        grallocWaitFenceFd(pending->fenceFd, "GrallocFenceWaiter");
+        pending->callback();
+    }
+
+private:
+    struct Pending {
+        base::unique_fd fenceFd;
+        Callback callback;
+        std::chrono::steady_clock::time_point startTime;
+        bool warned = false;
+    };
+
+    static constexpr int kWarningTimeoutMs = 3500;
+
+    void start() {
+        mEpollFd.reset(epoll_create1(EPOLL_CLOEXEC));
+        if (mEpollFd < 0) {
+            ALOGE("failed to create fence waiter epoll: %s", strerror(errno));
+            return;
+        }
+
+        pthread_t thread;
+        const int error = pthread_create(&thread, nullptr, &GrallocFenceWaiter::threadMain, this);
+        if (error) {
+            // without the thread, waitAsync blocks the caller instead
+            ALOGE("failed to start fence waiter: %s", strerror(error));
+            mEpollFd.reset();
+            return;
+        }
+        pthread_detach(thread);
+    }
+
+    static void* threadMain(void* waiter) {
+        static_cast<GrallocFenceWaiter*>(waiter)->threadLoop();
+        return nullptr;
+    }
+
+    void threadLoop() {
+        constexpr int kMaxEvents = 16;
+        struct epoll_event events[kMaxEvents];
+
+        while (true) {
+            const int count = epoll_wait(mEpollFd, events, kMaxEvents, kWarningTimeoutMs);
+            if (count < 0) {
+                if (errno != EINTR) {
+                    ALOGE("fence waiter epoll_wait failed: %s", strerror(errno));
+                }
+                continue;
+            }
+
+            for (int i = 0; i < count; i++) {
+                std::unique_ptr<Pending> pending(static_cast<Pending*>(events[i].data.ptr));
+                {
+                    std::lock_guard<std::mutex> lock(mMutex);
+                    epoll_ctl(mEpollFd, EPOLL_CTL_DEL, pending->fenceFd, nullptr);
+                    mPending.erase(pending.get());
+                }
+                pending->callback();
+            }
+
+            warnStalledFences();
+        }
+    }
+
+    void warnStalledFences() {
+        const auto now = std::chrono::steady_clock::now();
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        for (Pending* pending : mPending) {
+            if (!pending->warned &&
+                now - pending->startTime > std::chrono::milliseconds(kWarningTimeoutMs)) {
+                ALOGE("GrallocFenceWaiter: fence %d didn't signal in %u ms",
+                      pending->fenceFd.get(), kWarningTimeoutMs);
+                pending->warned = true;
+            }
+        }
+    }
+
+    std::once_flag mStartFlag;
+    base::unique_fd mEpollFd;
+
+    std::mutex mMutex;
+    std::unordered_set<Pending*> mPending;
+};
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
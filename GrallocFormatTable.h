@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+
+#include <hardware/gralloc.h>
+#include "MapperHal.h"
+#include "../hwcomposer/img_gralloc_common_public.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+using hal::BufferMetadata;
+
+// Static description of a pixel format and of which HALs accept it
+struct GrallocFormatInfo {
+    // supportFlags bits
+    static constexpr uint8_t kGralloc0 = 1 << 0;
+    static constexpr uint8_t kGralloc1 = 1 << 1;
+
+    int32_t format;
+    uint8_t supportFlags;
+    uint8_t numPlanes;
+    uint8_t bitsPerPixel;
+    BufferMetadata::FormatClass formatClass;
+};
+
+namespace detail {
+
+using FormatClass = BufferMetadata::FormatClass;
+
+constexpr uint8_t kGralloc0 = GrallocFormatInfo::kGralloc0;
+constexpr uint8_t kGralloc1 = GrallocFormatInfo::kGralloc1;
+
+// gralloc0 used to test formats against a bitwise OR of the formats it
+// listed, which includes HAL_PIXEL_FORMAT_BGRX_8888 (0x1ff) and so accepted
+// every format value up to 0x1ff.  The formats of this table in that range
+// stay supported on gralloc0 for that reason, listed or not.
+constexpr GrallocFormatInfo kGrallocFormats[] = {
+    {HAL_PIXEL_FORMAT_RGBA_8888, kGralloc0 | kGralloc1, 1, 32, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_RGBX_8888, kGralloc0 | kGralloc1, 1, 32, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_RGB_888, kGralloc0, 1, 24, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_RGB_565, kGralloc0 | kGralloc1, 1, 16, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_BGRA_8888, kGralloc0 | kGralloc1, 1, 32, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_BGRX_8888, kGralloc0, 1, 32, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_RGBA_FP16, kGralloc0 | kGralloc1, 1, 64, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_RGBA_1010102, kGralloc0 | kGralloc1, 1, 32, FormatClass::RGB},
+    {HAL_PIXEL_FORMAT_UYVY, kGralloc0 | kGralloc1, 1, 16, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_NV12, kGralloc0, 2, 12, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_NV12_CUSTOM, kGralloc0, 2, 12, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_NV21, kGralloc0, 2, 12, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_NV21_CUSTOM, kGralloc0, 2, 12, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_YCRCB_420_SP, kGralloc0 | kGralloc1, 2, 12, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_YV12, kGralloc0 | kGralloc1, 3, 12, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_YCBCR_420_888, kGralloc0 | kGralloc1, 3, 12, FormatClass::YUV},
+    {HAL_PIXEL_FORMAT_RAW16, kGralloc0 | kGralloc1, 1, 16, FormatClass::UNKNOWN},
+    {HAL_PIXEL_FORMAT_RAW10, kGralloc0 | kGralloc1, 1, 10, FormatClass::UNKNOWN},
+    {HAL_PIXEL_FORMAT_RAW12, kGralloc0 | kGralloc1, 1, 12, FormatClass::UNKNOWN},
+    {HAL_PIXEL_FORMAT_BLOB, kGralloc0 | kGralloc1, 1, 8, FormatClass::UNKNOWN},
+    {HAL_PIXEL_FORMAT_IMPLEMENTATION_DEFINED, kGralloc0 | kGralloc1, 1, 0, FormatClass::UNKNOWN},
+};
+
+constexpr size_t kFormatCount = sizeof(kGrallocFormats) / sizeof(kGrallocFormats[0]);
+
+// open addressing table, kept at most half full so that lookups almost
+// always resolve on the first probe
+constexpr uint32_t kFormatTableBits = 6;
+constexpr size_t kFormatTableSize = 1u << kFormatTableBits;
+static_assert(kFormatCount * 2 <= kFormatTableSize, "format table too small");
+
+constexpr size_t formatTableIndex(int32_t format) {
+    return (static_cast<uint32_t>(format) * 0x9e3779b1u) >> (32 - kFormatTableBits);
+}
+
+// format 0 is never valid and marks an empty slot
+constexpr std::array<GrallocFormatInfo, kFormatTableSize> buildFormatTable() {
+    std::array<GrallocFormatInfo, kFormatTableSize> table{};
+    for (size_t i = 0; i < kFormatCount; i++) {
+        size_t index = formatTableIndex(kGrallocFormats[i].format);
+        while (table[index].format != 0) {
+            index = (index + 1) & (kFormatTableSize - 1);
+        }
+        table[index] = kGrallocFormats[i];
+    }
+    return table;
+}
+
+constexpr std::array<GrallocFormatInfo, kFormatTableSize> kFormatTable = buildFormatTable();
+
+}  // namespace detail
+
+// look up a format, or return nullptr for formats we know nothing about
+constexpr const GrallocFormatInfo* grallocGetFormatInfo(int32_t format) {
+    if (format == 0) {
+        return nullptr;
+    }
+
+    size_t index = detail::formatTableIndex(format);
+    while (detail::kFormatTable[index].format != 0) {
+        if (detail::kFormatTable[index].format == format) {
+            return &detail::kFormatTable[index];
+        }
+        index = (index + 1) & (detail::kFormatTableSize - 1);
+    }
+
+    return nullptr;
+}
+
+constexpr bool grallocIsFormatSupported(int32_t format, uint8_t halFlag) {
+    const GrallocFormatInfo* info = grallocGetFormatInfo(format);
+    return info && (info->supportFlags & halFlag);
+}
+
+static_assert(grallocIsFormatSupported(HAL_PIXEL_FORMAT_YV12, GrallocFormatInfo::kGralloc0),
+              "format table lookup is broken");
+static_assert(!grallocIsFormatSupported(HAL_PIXEL_FORMAT_RGB_888, GrallocFormatInfo::kGralloc1),
+              "format table lookup is broken");
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,240 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef LOG_TAG
+#warning "GrallocHandlePool.h included without LOG_TAG"
+#endif
+
+#include <string.h>
+#include <unistd.h>
+
+#include <array>
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <cutils/native_handle.h>
+#include <log/log.h>
+#include "MapperStats.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+using hal::MapperStats;
+
+// GrallocHandlePool replaces native_handle_clone/native_handle_delete for
+// imported buffer handles.  Handles are carved out of size-classed slabs
+// that are recycled through per-class free lists, so that buffer churn does
+// not turn into small malloc/free pairs.  Handles too large for any class,
+// or cloned once the slabs of their class are exhausted, fall back to
+// native_handle_clone.
+//
+// The imported handle is also the buffer handed to the client, so a freed
+// handle is not reused right away: free slots are recycled oldest first,
+// and only once kReuseDelay more slots of their class have been freed.
+// Handles from native_handle_clone are likewise only deleted once
+// kReuseDelay more of them have been destroyed, so that malloc does not
+// hand their memory out again right away.  Until then a stale buffer of the
+// client still fails the lookup instead of hitting the buffer imported
+// next.
+//
+// Handles cloned by the pool must be destroyed by the same pool.
+class GrallocHandlePool {
+public:
+    GrallocHandlePool() = default;
+    GrallocHandlePool(const GrallocHandlePool&) = delete;
+    GrallocHandlePool& operator=(const GrallocHandlePool&) = delete;
+
+    // like native_handle_clone
+    native_handle_t* clone(const native_handle_t* handle) {
+        const int numData = handle->numFds + handle->numInts;
+        void* slot = allocate(numData);
+        if (!slot) {
+            MapperStats::add(MapperStats::Counter::HANDLE_SLAB_FALLBACKS, 1);
+            return native_handle_clone(handle);
+        }
+
+        auto clone = static_cast<native_handle_t*>(slot);
+        clone->version = sizeof(native_handle_t);
+        clone->numFds = handle->numFds;
+        clone->numInts = handle->numInts;
+
+        for (int i = 0; i < handle->numFds; i++) {
+            clone->data[i] = dup(handle->data[i]);
+            if (clone->data[i] < 0) {
+                clone->numFds = i;
+                native_handle_close(clone);
+                deallocate(numData, slot);
+                return nullptr;
+            }
+        }
+        memcpy(&clone->data[handle->numFds], &handle->data[handle->numFds],
+               sizeof(int) * handle->numInts);
+
+        MapperStats::add(MapperStats::Counter::HANDLE_SLAB_HITS, 1);
+        return clone;
+    }
+
+    // like native_handle_close followed by native_handle_delete
+    void destroy(native_handle_t* handle) {
+        native_handle_close(handle);
+        if (!deallocate(handle->numFds + handle->numInts, handle)) {
+            retire(handle);
+        }
+    }
+
+private:
+    // number of data words, i.e. fds and ints, of each size class
+    static constexpr std::array<int, 3> kClassData = {16, 32, 64};
+    static constexpr size_t kSlotsPerSlab = 64;
+    // a class stops growing at kSlotsPerSlab * kMaxSlabsPerClass handles
+    static constexpr size_t kMaxSlabsPerClass = 16;
+    // the number of slots freed after a slot before it is reused, unless
+    // the class cannot grow any more
+    static constexpr size_t kReuseDelay = 64;
+
+    struct FreeSlot {
+        FreeSlot* next;
+    };
+
+    struct SizeClass {
+        std::mutex mutex;
+        // free slots, oldest first
+        FreeSlot* freeHead = nullptr;
+        FreeSlot* freeTail = nullptr;
+        size_t freeCount = 0;
+        // slots of the last slab not handed out yet
+        size_t slabSlotsLeft = 0;
+        std::vector<std::unique_ptr<uint8_t[]>> slabs;
+    };
+
+    static constexpr size_t getSlotSize(size_t classIndex) {
+        const size_t size = sizeof(native_handle_t) + sizeof(int) * kClassData[classIndex];
+        return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    }
+
+    static int getClassIndex(int numData) {
+        for (size_t i = 0; i < kClassData.size(); i++) {
+            if (numData <= kClassData[i]) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    void* allocate(int numData) {
+        const int classIndex = getClassIndex(numData);
+        if (classIndex < 0) {
+            return nullptr;
+        }
+
+        SizeClass& sizeClass = mClasses[classIndex];
+        std::lock_guard<std::mutex> lock(sizeClass.mutex);
+        if (sizeClass.freeCount > kReuseDelay) {
+            return popFreeSlot(&sizeClass);
+        }
+
+        if (!sizeClass.slabSlotsLeft && sizeClass.slabs.size() < kMaxSlabsPerClass) {
+            sizeClass.slabs.emplace_back(new uint8_t[getSlotSize(classIndex) * kSlotsPerSlab]);
+            sizeClass.slabSlotsLeft = kSlotsPerSlab;
+        }
+        if (sizeClass.slabSlotsLeft) {
+            const size_t slotIndex = kSlotsPerSlab - sizeClass.slabSlotsLeft--;
+            return sizeClass.slabs.back().get() + getSlotSize(classIndex) * slotIndex;
+        }
+
+        return sizeClass.freeCount ? popFreeSlot(&sizeClass) : nullptr;
+    }
+
+    static void* popFreeSlot(SizeClass* sizeClass) {
+        FreeSlot* slot = sizeClass->freeHead;
+        sizeClass->freeHead = slot->next;
+        if (!sizeClass->freeHead) {
+            sizeClass->freeTail = nullptr;
+        }
+        sizeClass->freeCount--;
+        return slot;
+    }
+
+    // delete a handle from native_handle_clone once it is old enough
+    void retire(native_handle_t* handle) {
+        native_handle_t* oldHandle = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(mRetiredMutex);
+            mRetired.push_back(handle);
+            if (mRetired.size() > kReuseDelay) {
+                oldHandle = mRetired.front();
+                mRetired.pop_front();
+            }
+        }
+
+        if (oldHandle) {
+            native_handle_delete(oldHandle);
+        }
+    }
+
+    // returns false when the slot does not come from the pool
+    bool deallocate(int numData, void* slot) {
+        const int classIndex = getClassIndex(numData);
+        if (classIndex < 0) {
+            return false;
+        }
+
+        SizeClass& sizeClass = mClasses[classIndex];
+        const size_t slabSize = getSlotSize(classIndex) * kSlotsPerSlab;
+        const auto address = static_cast<const uint8_t*>(slot);
+        std::lock_guard<std::mutex> lock(sizeClass.mutex);
+        for (const auto& slab : sizeClass.slabs) {
+            const uint8_t* begin = slab.get();
+            if (address >= begin && address < begin + slabSize) {
+                auto freeSlot = static_cast<FreeSlot*>(slot);
+                freeSlot->next = nullptr;
+                if (sizeClass.freeTail) {
+                    sizeClass.freeTail->next = freeSlot;
+                } else {
+                    sizeClass.freeHead = freeSlot;
+                }
+                sizeClass.freeTail = freeSlot;
+                sizeClass.freeCount++;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::array<SizeClass, kClassData.size()> mClasses;
+
+    // closed handles from native_handle_clone, oldest first
+    std::mutex mRetiredMutex;
+    std::deque<native_handle_t*> mRetired;
+};
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+
+#include <cutils/native_handle.h>
+#include <cutils/properties.h>
+#include "MapperStats.h"
+#include "../hwcomposer/img_gralloc_common_public.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+using hal::MapperStats;
+
+// GrallocImportCache lets repeated imports of the same buffer share one
+// vendor registration instead of registering a new handle each time.  Every
+// import still clones a handle of its own, which is the buffer handed to
+// the client and has its own lock state, but the later imports only alias
+// the handle registered by the first one: the module is always called with
+// that handle, and it is only unregistered when the last import is freed.
+//
+// A buffer is identified by the allocation stamp of its IMG_native_handle_t
+// together with the device and inode of its first dma-buf.  The inode
+// cannot be reused while the registered handle keeps the dma-buf open.
+//
+// The cache is opt-in through ro.vendor.gralloc.mapper.import_dedup, as the
+// vendor module then sees the locks of all imports of a buffer on a single
+// handle.
+class GrallocImportCache {
+public:
+    struct Key {
+        uint64_t stamp;
+        dev_t device;
+        ino_t inode;
+
+        bool operator==(const Key& other) const {
+            return stamp == other.stamp && device == other.device && inode == other.inode;
+        }
+    };
+
+    void initFromProperties() {
+        mEnabled = property_get_bool("ro.vendor.gralloc.mapper.import_dedup", false);
+    }
+
+    bool isEnabled() const { return mEnabled; }
+
+    // Identify the buffer of rawHandle.  Returns false when the cache is
+    // disabled or the buffer cannot be told apart from others.
+    bool getKey(const native_handle_t* rawHandle, Key* outKey) const {
+        if (!mEnabled || rawHandle->numFds < 1 ||
+            static_cast<size_t>(rawHandle->numFds + rawHandle->numInts) * sizeof(int) <
+                sizeof(IMG_native_handle_t) - sizeof(native_handle_t)) {
+            return false;
+        }
+
+        const IMG_native_handle_t* imgHandle =
+            reinterpret_cast<const IMG_native_handle_t*>(rawHandle);
+        struct stat st;
+        if (!imgHandle->ui64Stamp || fstat(rawHandle->data[0], &st)) {
+            return false;
+        }
+
+        *outKey = Key{imgHandle->ui64Stamp, st.st_dev, st.st_ino};
+        return true;
+    }
+
+    // Make aliasHandle, a new clone of a buffer, share the handle already
+    // registered for key.  Returns false when there is none.
+    bool acquire(const Key& key, native_handle_t* aliasHandle) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mEntries.find(key);
+        if (it == mEntries.end()) {
+            return false;
+        }
+
+        Entry& entry = it->second;
+        if (entry.handle->numFds != aliasHandle->numFds ||
+            entry.handle->numInts != aliasHandle->numInts) {
+            return false;
+        }
+
+        entry.refs++;
+        mAliases.emplace(aliasHandle, entry.handle);
+        MapperStats::add(MapperStats::Counter::IMPORTS_SHARED, 1);
+        return true;
+    }
+
+    // the handle registered with the module for an imported handle
+    native_handle_t* getRegisteredHandle(native_handle_t* bufferHandle) {
+        if (!mEnabled) {
+            return bufferHandle;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mAliases.find(bufferHandle);
+        return it != mAliases.end() ? it->second : bufferHandle;
+    }
+
+    // Remember a newly imported handle for key.  When another thread got
+    // there first, the handle simply stays unshared.
+    void insert(const Key& key, native_handle_t* bufferHandle) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        if (mEntries.emplace(key, Entry{bufferHandle, 1}).second) {
+            mKeys.emplace(bufferHandle, key);
+        }
+    }
+
+    // Drop the reference of an imported handle to its registered handle,
+    // which is returned in outRegisteredHandle.  Returns true when it was
+    // the last one, or the handle was never shared, and the registered
+    // handle must be unregistered.
+    bool release(native_handle_t* bufferHandle, native_handle_t** outRegisteredHandle) {
+        *outRegisteredHandle = bufferHandle;
+        if (!mEnabled) {
+            return true;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto aliasIt = mAliases.find(bufferHandle);
+        if (aliasIt != mAliases.end()) {
+            *outRegisteredHandle = aliasIt->second;
+            mAliases.erase(aliasIt);
+        }
+
+        auto keyIt = mKeys.find(*outRegisteredHandle);
+        if (keyIt == mKeys.end()) {
+            return true;
+        }
+
+        auto it = mEntries.find(keyIt->second);
+        if (--it->second.refs) {
+            return false;
+        }
+
+        mEntries.erase(it);
+        mKeys.erase(keyIt);
+        return true;
+    }
+
+private:
+    struct KeyHash {
+        size_t operator()(const Key& key) const {
+            const size_t hash = std::hash<uint64_t>()(key.stamp);
+            return hash ^ (std::hash<uint64_t>()(key.inode) + 0x9e3779b97f4a7c15ull +
+                           (hash << 6) + (hash >> 2));
+        }
+    };
+
+    struct Entry {
+        native_handle_t* handle;
+        uint32_t refs;
+    };
+
+    bool mEnabled = false;
+
+    std::mutex mMutex;
+    std::unordered_map<Key, Entry, KeyHash> mEntries;
+    std::unordered_map<const native_handle_t*, Key> mKeys;
+    // the registered handle of each alias
+    std::unordered_map<const native_handle_t*, native_handle_t*> mAliases;
+};
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
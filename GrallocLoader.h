@@ -20,13 +20,17 @@
 #warning "GrallocLoader.h included without LOG_TAG"
 #endif
 
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
 #include <memory>
 #include <mutex>
-#include <unordered_set>
 
 #include <hardware/gralloc.h>
 #include <hardware/hardware.h>
 #include <log/log.h>
+#include "BufferTracker.h"
 #include "Mapper.h"
 #include "Gralloc0Hal.h"
 #include "Gralloc1Hal.h"
@@ -59,47 +63,290 @@ public:
         return *singleton;
     }
 
-    void* add(native_handle_t* bufferHandle) {
-        std::lock_guard<std::mutex> lock(mMutex);
-        return mBufferHandles.insert(bufferHandle).second ? bufferHandle : nullptr;
+    // Add an imported handle; the handle itself is the buffer handed to the
+    // client.  registeredHandle is the handle the module knows the buffer
+    // by, which imports sharing a registration through GrallocImportCache
+    // have in common.  Each import still has a lock state of its own.
+    void* add(native_handle_t* bufferHandle, native_handle_t* registeredHandle,
+              const hal::BufferMetadata& metadata) {
+        Shard& shard = getShard(bufferHandle);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        addLocked(&shard, bufferHandle, registeredHandle, metadata);
+        track(registeredHandle, metadata);
+        return bufferHandle;
+    }
+
+    // Remove a buffer.  Returns false for unknown buffers.  Otherwise
+    // *outBufferHandle is the handle to free, or nullptr when the buffer is
+    // pinned: its handle is then returned by the last unpin instead.
+    bool remove(void* buffer, native_handle_t** outBufferHandle) {
+        Shard& shard = getShard(buffer);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        native_handle_t* registeredHandle = removeLocked(&shard, buffer, outBufferHandle);
+        if (!registeredHandle) {
+            return false;
+        }
+
+        mTracker.remove(registeredHandle);
+        return true;
+    }
+
+    // Pin a buffer for work that outlives the call that started it, such as
+    // a lock waiting for its acquire fence.  The returned entry stays valid,
+    // and its handle imported, until the buffer is unpinned, even when the
+    // client frees the buffer in the meantime.  Returns nullptr for unknown
+    // buffers.
+    const hal::ImportedBuffer* pin(void* buffer) {
+        Shard& shard = getShard(buffer);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Node* node = findNode(shard, buffer);
+        if (!node) {
+            return nullptr;
+        }
+
+        node->pins++;
+        return &node->buffer;
+    }
+
+    // Unpin a buffer.  Returns the handle to free when the buffer was freed
+    // while it was pinned and this was its last pin, and nullptr otherwise.
+    native_handle_t* unpin(void* buffer) {
+        Shard& shard = getShard(buffer);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        Node* node = findPinnedNode(shard, buffer);
+        if (!node) {
+            ALOGE("unpinning buffer %p that is not pinned", buffer);
+            return nullptr;
+        }
+
+        return (!--node->pins && !node->imported) ? node->importHandle : nullptr;
+    }
+
+    // Lookups are lock-free: a buffer is valid as long as a node of its
+    // bucket is published under it.  The returned entry stays valid until
+    // the buffer is removed, which the client must not do while it is
+    // still using the buffer, or until it is unpinned.
+    //
+    // A freed buffer is rejected as long as no later import got its handle
+    // address.  GrallocHandlePool holds freed handles back before reusing
+    // them, so that takes many imports and frees rather than the next one.
+    //
+    // This is a hash and a walk of a bucket that normally holds a node or
+    // two, with no shared writes, so a per-thread cache of recently used
+    // buffers would not be any cheaper: its TLS access and the check of a
+    // removal epoch cost as much.
+    const hal::ImportedBuffer* get(void* buffer) const {
+        const Node* node = findNode(getShard(buffer), buffer);
+        return node ? &node->buffer : nullptr;
     }
 
-    native_handle_t* remove(void* buffer) {
-        auto bufferHandle = static_cast<native_handle_t*>(buffer);
+    // add several buffers, taking the lock of each shard involved once
+    void addBatch(native_handle_t* const* bufferHandles, native_handle_t* const* registeredHandles,
+                  const hal::BufferMetadata* metadata, size_t count, void** outBuffers) {
+        for (size_t shardIndex = 0; shardIndex < kShardCount; shardIndex++) {
+            Shard& shard = mShards[shardIndex];
+            std::unique_lock<std::mutex> lock(shard.mutex, std::defer_lock);
+            for (size_t i = 0; i < count; i++) {
+                if (getShardIndex(bufferHandles[i]) != shardIndex) {
+                    continue;
+                }
+                if (!lock.owns_lock()) {
+                    lock.lock();
+                }
+                addLocked(&shard, bufferHandles[i], registeredHandles[i], metadata[i]);
+                track(registeredHandles[i], metadata[i]);
+                outBuffers[i] = bufferHandles[i];
+            }
+        }
+    }
 
-        std::lock_guard<std::mutex> lock(mMutex);
-        return mBufferHandles.erase(bufferHandle) == 1 ? bufferHandle : nullptr;
+    // Remove several buffers, taking the lock of each shard involved once,
+    // and return how many of them were known.  outBufferHandles receives
+    // the handles to free, or nullptr as remove() does and for unknown
+    // buffers.
+    size_t removeBatch(void* const* buffers, size_t count, native_handle_t** outBufferHandles) {
+        size_t removed = 0;
+        for (size_t shardIndex = 0; shardIndex < kShardCount; shardIndex++) {
+            Shard& shard = mShards[shardIndex];
+            std::unique_lock<std::mutex> lock(shard.mutex, std::defer_lock);
+            for (size_t i = 0; i < count; i++) {
+                if (getShardIndex(buffers[i]) != shardIndex) {
+                    continue;
+                }
+                if (!lock.owns_lock()) {
+                    lock.lock();
+                }
+                outBufferHandles[i] = nullptr;
+                native_handle_t* registeredHandle =
+                    removeLocked(&shard, buffers[i], &outBufferHandles[i]);
+                if (registeredHandle) {
+                    mTracker.remove(registeredHandle);
+                    removed++;
+                }
+            }
+        }
+
+        return removed;
     }
 
-    const native_handle_t* get(void* buffer) const {
-        auto bufferHandle = static_cast<const native_handle_t*>(buffer);
+    // the live buffers and the bytes they hold, for leak hunting
+    const hal::BufferTracker& getTracker() const { return mTracker; }
+
+    bool getBatch(void* const* buffers, size_t count,
+                  const hal::ImportedBuffer** outImportedBuffers) const {
+        for (size_t i = 0; i < count; i++) {
+            outImportedBuffers[i] = get(buffers[i]);
+            if (!outImportedBuffers[i]) {
+                return false;
+            }
+        }
 
-        std::lock_guard<std::mutex> lock(mMutex);
-        return mBufferHandles.count(bufferHandle) == 1 ? bufferHandle : nullptr;
+        return true;
     }
 
 private:
-    mutable std::mutex mMutex;
-    std::unordered_set<const native_handle_t*> mBufferHandles;
-};
+    GrallocImportedBufferPool() { mTracker.initFromProperties(); }
+
+    // Buffers are spread over independently locked shards, so that imports
+    // and frees on different threads usually do not serialize, and over
+    // the buckets of each shard, so that a lookup normally checks a single
+    // node.
+    static constexpr uint32_t kShardBits = 4;
+    static constexpr size_t kShardCount = size_t(1) << kShardBits;
+    static constexpr uint32_t kBucketBits = 5;
+    static constexpr size_t kBucketCount = size_t(1) << kBucketBits;
+
+    // Nodes are never freed and never leave the bucket they were first
+    // added to; a removed node is only reused for a later buffer of the
+    // same bucket.  A lookup racing with an add or a remove therefore
+    // never reads freed memory, nor misses a buffer that stays in the pool.
+    struct Node {
+        // the handle the node is published under, or nullptr while unused
+        std::atomic<const void*> key{nullptr};
+        // written before the node is published, and never changed
+        Node* next = nullptr;
+        // the handle of the import, which buffer.handle is the registered
+        // handle of
+        native_handle_t* importHandle = nullptr;
+        // whether the buffer is imported, and the number of pins keeping it
+        // imported; the node is only reused once neither holds
+        bool imported = false;
+        uint32_t pins = 0;
+        hal::ImportedBuffer buffer = {nullptr, {}, {}};
+    };
+
+    struct alignas(64) Shard {
+        // protects everything but the lock-free reads of the bucket lists
+        // and of Node::key
+        std::mutex mutex;
+        std::array<std::atomic<Node*>, kBucketCount> buckets = {};
+    };
+
+    static uint64_t getHash(const void* buffer) {
+        // handles are heap allocated, so the low bits carry no entropy
+        return (static_cast<uint64_t>(reinterpret_cast<uintptr_t>(buffer)) >> 4) *
+               0x9e3779b97f4a7c15ull;
+    }
+
+    static size_t getShardIndex(const void* buffer) {
+        return getHash(buffer) >> (64 - kShardBits);
+    }
 
-// Inherit from V3_0::renesas::hal::Mapper and override imported buffer management functions
-template <typename T>
-class GrallocMapper : public T {
-protected:
-    void* addImportedBuffer(native_handle_t* bufferHandle) override {
-        return GrallocImportedBufferPool::getInstance().add(bufferHandle);
+    static size_t getBucketIndex(const void* buffer) {
+        return (getHash(buffer) >> (64 - kShardBits - kBucketBits)) & (kBucketCount - 1);
     }
 
-    native_handle_t* removeImportedBuffer(void* buffer) override {
-        return GrallocImportedBufferPool::getInstance().remove(buffer);
+    Shard& getShard(const void* buffer) { return mShards[getShardIndex(buffer)]; }
+
+    const Shard& getShard(const void* buffer) const { return mShards[getShardIndex(buffer)]; }
+
+    static Node* findNode(const Shard& shard, const void* buffer) {
+        if (!buffer) {
+            return nullptr;
+        }
+
+        Node* node = shard.buckets[getBucketIndex(buffer)].load(std::memory_order_acquire);
+        for (; node; node = node->next) {
+            if (node->key.load(std::memory_order_acquire) == buffer) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    // find a pinned node, whether or not it is still published; called with
+    // the shard lock held
+    static Node* findPinnedNode(const Shard& shard, const void* buffer) {
+        Node* node = shard.buckets[getBucketIndex(buffer)].load(std::memory_order_relaxed);
+        for (; node; node = node->next) {
+            if (node->pins && node->importHandle == buffer) {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    void addLocked(Shard* shard, native_handle_t* bufferHandle, native_handle_t* registeredHandle,
+                   const hal::BufferMetadata& metadata) {
+        std::atomic<Node*>& bucket = shard->buckets[getBucketIndex(bufferHandle)];
+        Node* node = bucket.load(std::memory_order_relaxed);
+        for (; node; node = node->next) {
+            if (!node->imported && !node->pins) {
+                break;
+            }
+        }
+        if (!node) {
+            node = new Node;
+            node->next = bucket.load(std::memory_order_relaxed);
+            bucket.store(node, std::memory_order_release);
+        }
+
+        node->importHandle = bufferHandle;
+        node->imported = true;
+        node->buffer.handle = registeredHandle;
+        node->buffer.metadata = metadata;
+        node->buffer.lockState.reset();
+        node->key.store(bufferHandle, std::memory_order_release);
     }
 
-    const native_handle_t* getImportedBuffer(void* buffer) const override {
-        return GrallocImportedBufferPool::getInstance().get(buffer);
+    // returns the registered handle of the buffer, or nullptr when it is
+    // unknown
+    native_handle_t* removeLocked(Shard* shard, void* buffer, native_handle_t** outBufferHandle) {
+        Node* node = findNode(*shard, buffer);
+        if (!node) {
+            return nullptr;
+        }
+
+        node->imported = false;
+        node->key.store(nullptr, std::memory_order_relaxed);
+
+        *outBufferHandle = node->pins ? nullptr : node->importHandle;
+        return node->buffer.handle;
     }
+
+    // Recorded under the registered handle, so that imports sharing it count
+    // once, and under the shard lock of the import: the registered handle
+    // is only released, and its address free for reuse, after the removal
+    // is recorded, so an import and the free of an earlier buffer at the
+    // same address cannot be recorded out of order.
+    void track(native_handle_t* registeredHandle, const hal::BufferMetadata& metadata) {
+        if (mTracker.isEnabled()) {
+            mTracker.add(registeredHandle, grallocGetBufferSize(registeredHandle),
+                         metadata.format, grallocGetBufferUsage(registeredHandle));
+        }
+    }
+
+    std::array<Shard, kShardCount> mShards;
+
+    hal::BufferTracker mTracker;
 };
 
+// a mapper on top of the given HAL, keeping imported buffers in
+// GrallocImportedBufferPool.  All such mappers are instantiated in
+// Mapper.cpp.
+template <typename Hal>
+using GrallocMapper = hal::Mapper<Hal, GrallocImportedBufferPool>;
+
 class GrallocLoader {
 public:
     static IMapper* load() {
@@ -107,11 +354,7 @@ public:
         if (!module) {
             return nullptr;
         }
-        auto hal = createHal(module);
-        if (!hal) {
-            return nullptr;
-        }
-        return createMapper(std::move(hal));
+        return createMapper(module);
     }
 
     // load the gralloc module
@@ -131,27 +374,30 @@ public:
         return majorApiVersionMask(module->module_api_version);
     }
 
-    // create a MapperHal instance
-    static std::unique_ptr<hal::MapperHal> createHal(const hw_module_t* module) {
+    // Create the IMapper instance for the module.  The HAL is picked once
+    // here, so that no call has to check the module version again.
+    static IMapper* createMapper(const hw_module_t* module) {
         int major = getModuleMajorApiVersion(module);
         switch (major) {
-            case 1: {
-                auto hal = std::make_unique<Gralloc1Hal>();
-                return hal->initWithModule(module) ? std::move(hal) : nullptr;
-            }
-            case 0: {
-                auto hal = std::make_unique<Gralloc0Hal>();
-                return hal->initWithModule(module) ? std::move(hal) : nullptr;
-            }
+            case 1:
+                return createMapperWithHal<Gralloc1Hal>(module);
+            case 0:
+                return gralloc0HasAsyncLock(module) ? createMapperWithHal<Gralloc0AsyncHal>(module)
+                                                    : createMapperWithHal<Gralloc0SyncHal>(module);
             default:
                 ALOGE("unknown gralloc module major version %d", major);
                 return nullptr;
         }
     }
 
-    // create an IAllocator instance
-    static IMapper* createMapper(std::unique_ptr<hal::MapperHal> hal) {
-        auto mapper = std::make_unique<GrallocMapper<hal::Mapper>>();
+    template <typename Hal>
+    static IMapper* createMapperWithHal(const hw_module_t* module) {
+        auto hal = std::make_unique<Hal>();
+        if (!hal->initWithModule(module)) {
+            return nullptr;
+        }
+
+        auto mapper = std::make_unique<GrallocMapper<Hal>>();
         return mapper->init(std::move(hal)) ? mapper.release() : nullptr;
     }
 };
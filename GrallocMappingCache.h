@@ -0,0 +1,385 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef LOG_TAG
+#warning "GrallocMappingCache.h included without LOG_TAG"
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include <android/hardware/graphics/mapper/3.0/IMapper.h>
+#include <cutils/native_handle.h>
+#include <cutils/properties.h>
+#include <linux/dma-buf.h>
+#include <log/log.h>
+#include "GrallocBufferMetadata.h"
+#include "GrallocSyncRegion.h"
+#include "MapperStats.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+// Partial cache maintenance is a vendor extension of the dma-buf uapi.  The
+// definition below must match the kernel; kernels without it reject the
+// ioctl and the cache falls back to DMA_BUF_IOCTL_SYNC on the whole buffer.
+#ifndef DMA_BUF_IOCTL_SYNC_PARTIAL
+struct dma_buf_sync_partial {
+    __u64 flags;
+    __u32 reserved;
+    __u32 len;
+    __u64 offset;
+};
+
+#define DMA_BUF_IOCTL_SYNC_PARTIAL _IOW(DMA_BUF_BASE, 2, struct dma_buf_sync_partial)
+#endif
+
+// GrallocMappingCache keeps the CPU mapping of locked buffers alive between
+// unlock and the next lock, so that buffers cycling through a BufferQueue
+// are not mmapped and munmapped by the vendor module every frame.  Cache
+// maintenance is done with DMA_BUF_IOCTL_SYNC around every lock, limited to
+// the rows of the access region when the buffer layout allows it.
+//
+// The cache is opt-in: it is only enabled when
+// ro.vendor.gralloc.mapper.mapping_cache_mb sets an address space budget.
+// Mappings that are not locked are evicted in LRU order to stay within it.
+//
+// Buffers of at least ro.vendor.gralloc.mapper.hugepage_mapping_kb that are
+// first locked for frequent CPU access are mapped at a 2MB aligned address
+// with MADV_HUGEPAGE, so that exporters able to back them with huge pages
+// can map them with PMD entries and spare the CPU dTLB misses.  The hint is
+// all the cache controls: an exporter may still map such a buffer with
+// small pages.
+class GrallocMappingCache {
+public:
+    ~GrallocMappingCache() {
+        for (auto& entry : mEntries) {
+            unmap(&entry.second);
+        }
+    }
+
+    void initFromProperties() {
+        const int32_t budgetMb =
+            property_get_int32("ro.vendor.gralloc.mapper.mapping_cache_mb", 0);
+        mBudgetBytes = budgetMb > 0 ? static_cast<size_t>(budgetMb) << 20 : 0;
+
+        const int32_t hugepageKb =
+            property_get_int32("ro.vendor.gralloc.mapper.hugepage_mapping_kb", 0);
+        mHugepageMinBytes = hugepageKb > 0 ? static_cast<size_t>(hugepageKb) << 10 : 0;
+    }
+
+    bool isEnabled() const { return mBudgetBytes != 0; }
+
+    // Begin CPU access to a buffer through its cached mapping, mapping it
+    // first if needed.  Returns nullptr when the buffer cannot be cached, in
+    // which case the caller falls back to the vendor lock.  The acquire
+    // fence must have signaled already.
+    void* lock(const native_handle_t* bufferHandle, uint64_t cpuUsage,
+               const IMapper::Rect& accessRegion) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        Entry* entry = findOrMap(bufferHandle, cpuUsage);
+        if (!entry) {
+            return nullptr;
+        }
+
+        GrallocSyncRange range;
+        if (!grallocGetSyncRange(entry->metadata, accessRegion, &range) ||
+            range.offset + range.length > entry->size) {
+            range = GrallocSyncRange{0, entry->size};
+        }
+
+        const uint64_t syncFlags = getSyncFlags(cpuUsage);
+        if (!sync(entry->fd, DMA_BUF_SYNC_START | syncFlags, range, entry->size)) {
+            return nullptr;
+        }
+
+        // the end of CPU access covers every region locked meanwhile
+        if (entry->lockCount) {
+            const uint64_t end = std::max(entry->syncRange.offset + entry->syncRange.length,
+                                          range.offset + range.length);
+            entry->syncRange.offset = std::min(entry->syncRange.offset, range.offset);
+            entry->syncRange.length = end - entry->syncRange.offset;
+        } else {
+            entry->syncRange = range;
+        }
+        entry->syncFlags |= syncFlags;
+        entry->lockCount++;
+        mLru.splice(mLru.begin(), mLru, entry->lruPosition);
+
+        return entry->address;
+    }
+
+    // End CPU access begun by lock.  Returns false when the buffer holds no
+    // lock of the cache.
+    bool unlock(const native_handle_t* bufferHandle) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = mEntries.find(bufferHandle);
+        if (it == mEntries.end() || !it->second.lockCount) {
+            return false;
+        }
+
+        Entry& entry = it->second;
+        sync(entry.fd, DMA_BUF_SYNC_END | entry.syncFlags, entry.syncRange, entry.size);
+        if (--entry.lockCount == 0) {
+            entry.syncFlags = 0;
+        }
+
+        return true;
+    }
+
+    // drop the mapping of a buffer that is being freed
+    void release(const native_handle_t* bufferHandle) {
+        std::lock_guard<std::mutex> lock(mMutex);
+
+        auto it = mEntries.find(bufferHandle);
+        if (it == mEntries.end()) {
+            return;
+        }
+
+        ALOGW_IF(it->second.lockCount, "freeing buffer %p while it is still locked", bufferHandle);
+        unmap(&it->second);
+        mEntries.erase(it);
+    }
+
+private:
+    struct Entry {
+        int fd = -1;
+        void* address = nullptr;
+        size_t size = 0;
+        uint32_t lockCount = 0;
+        uint64_t syncFlags = 0;
+        // the bytes synced by the current locks
+        GrallocSyncRange syncRange = {0, 0};
+        BufferMetadata metadata;
+        std::list<const native_handle_t*>::iterator lruPosition;
+    };
+
+    static uint64_t getSyncFlags(uint64_t cpuUsage) {
+        uint64_t flags = 0;
+        if (cpuUsage & common::V1_2::BufferUsage::CPU_READ_MASK) {
+            flags |= DMA_BUF_SYNC_READ;
+        }
+        if (cpuUsage & common::V1_2::BufferUsage::CPU_WRITE_MASK) {
+            flags |= DMA_BUF_SYNC_WRITE;
+        }
+        return flags ? flags : DMA_BUF_SYNC_READ;
+    }
+
+    bool sync(int fd, uint64_t flags, const GrallocSyncRange& range, size_t size) {
+        if (range.length < size && mPartialSync) {
+            struct dma_buf_sync_partial sync = {};
+            sync.flags = flags;
+            sync.offset = range.offset;
+            sync.len = static_cast<__u32>(range.length);
+            if (!ioctl(fd, DMA_BUF_IOCTL_SYNC_PARTIAL, &sync)) {
+                return true;
+            }
+
+            if (errno != ENOTTY && errno != EINVAL) {
+                ALOGE("DMA_BUF_IOCTL_SYNC_PARTIAL(0x%llx) failed: %s",
+                      static_cast<unsigned long long>(flags), strerror(errno));
+                return false;
+            }
+
+            ALOGI("partial dma-buf sync is not supported, syncing whole buffers");
+            mPartialSync = false;
+        }
+
+        struct dma_buf_sync sync = {flags};
+        if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync)) {
+            ALOGE("DMA_BUF_IOCTL_SYNC(0x%llx) failed: %s", static_cast<unsigned long long>(flags),
+                  strerror(errno));
+            return false;
+        }
+        return true;
+    }
+
+    // Negative entries (address == nullptr) remember buffers that cannot be
+    // cached so that they are not probed again on every lock.
+    Entry* findOrMap(const native_handle_t* bufferHandle, uint64_t cpuUsage) {
+        auto it = mEntries.find(bufferHandle);
+        if (it != mEntries.end()) {
+            if (it->second.address) {
+                return &it->second;
+            }
+            if (it->second.size > mBudgetBytes) {
+                return nullptr;
+            }
+            // it may fit now that other mappings have been released
+            mEntries.erase(it);
+        }
+
+        Entry entry;
+        grallocGetBufferMetadata(bufferHandle, &entry.metadata);
+        // only buffers backed by a single dma-buf are mapped as a whole
+        if (bufferHandle->numFds == 1) {
+            entry.fd = bufferHandle->data[0];
+            const off_t size = lseek(entry.fd, 0, SEEK_END);
+            entry.size = size > 0 ? static_cast<size_t>(size) : 0;
+        }
+
+        if (!entry.size || entry.size > mBudgetBytes) {
+            entry.size = SIZE_MAX;
+            mEntries.emplace(bufferHandle, entry);
+            return nullptr;
+        }
+
+        if (!evict(entry.size)) {
+            mEntries.emplace(bufferHandle, entry);
+            return nullptr;
+        }
+
+        void* address = MAP_FAILED;
+        if (useHugepageMapping(entry.size, cpuUsage)) {
+            address = mapHugepageAligned(entry.fd, entry.size);
+        }
+        if (address == MAP_FAILED) {
+            address = mmap(nullptr, entry.size, PROT_READ | PROT_WRITE, MAP_SHARED, entry.fd, 0);
+        } else {
+            MapperStats::add(MapperStats::Counter::HUGEPAGE_HINTED_MAPPINGS, 1);
+        }
+        if (address == MAP_FAILED) {
+            ALOGW("failed to map buffer %p: %s", bufferHandle, strerror(errno));
+            entry.size = SIZE_MAX;
+            mEntries.emplace(bufferHandle, entry);
+            return nullptr;
+        }
+
+        MapperStats::add(MapperStats::Counter::CACHED_MAPPINGS, 1);
+        entry.address = address;
+        mMappedBytes += entry.size;
+        mLru.push_front(bufferHandle);
+        entry.lruPosition = mLru.begin();
+
+        return &mEntries.emplace(bufferHandle, entry).first->second;
+    }
+
+    bool useHugepageMapping(size_t size, uint64_t cpuUsage) const {
+        using common::V1_2::BufferUsage;
+        return mHugepageMinBytes && size >= mHugepageMinBytes &&
+               ((cpuUsage & BufferUsage::CPU_READ_MASK) ==
+                        static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN) ||
+                (cpuUsage & BufferUsage::CPU_WRITE_MASK) ==
+                        static_cast<uint64_t>(BufferUsage::CPU_WRITE_OFTEN));
+    }
+
+    // Map the buffer at a kHugepageSize aligned address and ask for huge
+    // pages.  Returns MAP_FAILED when the exporter rejects the hint, in
+    // which case the caller maps the buffer the usual way.
+    static void* mapHugepageAligned(int fd, size_t size) {
+        // reserve enough address space to find an aligned start in it
+        const size_t reservedSize = size + kHugepageSize;
+        void* reserved = mmap(nullptr, reservedSize, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reserved == MAP_FAILED) {
+            return MAP_FAILED;
+        }
+
+        const uintptr_t start = reinterpret_cast<uintptr_t>(reserved);
+        const uintptr_t alignedStart = (start + kHugepageSize - 1) & ~(kHugepageSize - 1);
+        void* address = mmap(reinterpret_cast<void*>(alignedStart), size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_FIXED, fd, 0);
+        if (address == MAP_FAILED) {
+            munmap(reserved, reservedSize);
+            return MAP_FAILED;
+        }
+
+        // give back the unused head and tail of the reservation
+        if (alignedStart > start) {
+            munmap(reserved, alignedStart - start);
+        }
+        const uintptr_t end = alignedStart + size;
+        const uintptr_t reservedEnd = start + reservedSize;
+        if (reservedEnd > end) {
+            munmap(reinterpret_cast<void*>(end), reservedEnd - end);
+        }
+
+        if (madvise(address, size, MADV_HUGEPAGE)) {
+            munmap(address, size);
+            return MAP_FAILED;
+        }
+
+        return address;
+    }
+
+    // make room for a new mapping of the given size
+    bool evict(size_t size) {
+        auto it = mLru.end();
+        while (mMappedBytes + size > mBudgetBytes && it != mLru.begin()) {
+            --it;
+            auto entryIt = mEntries.find(*it);
+            if (entryIt->second.lockCount) {
+                continue;
+            }
+
+            // unmap() drops the entry from the LRU list
+            it = std::next(it);
+            unmap(&entryIt->second);
+            mEntries.erase(entryIt);
+        }
+
+        return mMappedBytes + size <= mBudgetBytes;
+    }
+
+    void unmap(Entry* entry) {
+        if (!entry->address) {
+            return;
+        }
+
+        munmap(entry->address, entry->size);
+        mMappedBytes -= entry->size;
+        mLru.erase(entry->lruPosition);
+        entry->address = nullptr;
+    }
+
+    static constexpr size_t kHugepageSize = 2 << 20;
+
+    size_t mBudgetBytes = 0;
+    size_t mHugepageMinBytes = 0;
+    // cleared once the kernel turned DMA_BUF_IOCTL_SYNC_PARTIAL down
+    bool mPartialSync = true;
+
+    std::mutex mMutex;
+    std::unordered_map<const native_handle_t*, Entry> mEntries;
+    // most recently locked first
+    std::list<const native_handle_t*> mLru;
+    size_t mMappedBytes = 0;
+};
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
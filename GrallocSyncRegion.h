@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <android/hardware/graphics/mapper/3.0/IMapper.h>
+#include "MapperHal.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+using hal::BufferMetadata;
+
+// a byte range of a buffer that needs CPU cache maintenance
+struct GrallocSyncRange {
+    uint64_t offset;
+    uint64_t length;
+};
+
+// cache maintenance works on whole cache lines anyway
+constexpr uint64_t kGrallocSyncAlignment = 64;
+
+// Compute the byte range covering accessRegion, from the first byte of its
+// top row to the last byte of its bottom row.  Returns false when the
+// layout of the buffer is not known well enough, in which case the whole
+// buffer must be synced.
+//
+// Only RGB layouts with a whole number of bytes per pixel are handled.  The
+// chroma planes of the YUV formats start at an offset set by the vendor
+// allocator, RAW10/12 pixels span fractional bytes, and BLOB or
+// implementation defined buffers have no pixel grid at all.
+inline bool grallocGetSyncRange(const BufferMetadata& metadata, const IMapper::Rect& accessRegion,
+                                GrallocSyncRange* outRange) {
+    if (metadata.formatClass != BufferMetadata::FormatClass::RGB || metadata.numPlanes != 1 ||
+        !metadata.bitsPerPixel || metadata.bitsPerPixel % 8 || !metadata.planeStride[0]) {
+        return false;
+    }
+
+    // empty or out of bounds regions are treated as the whole buffer
+    if (accessRegion.left < 0 || accessRegion.top < 0 || accessRegion.width <= 0 ||
+        accessRegion.height <= 0 ||
+        static_cast<uint64_t>(accessRegion.left) + accessRegion.width > metadata.planeStride[0] ||
+        static_cast<uint64_t>(accessRegion.top) + accessRegion.height > metadata.height) {
+        return false;
+    }
+
+    const uint64_t bytesPerPixel = metadata.bytesPerPixel;
+    const uint64_t strideBytes = uint64_t(metadata.planeStride[0]) * bytesPerPixel;
+    const uint64_t begin = accessRegion.top * strideBytes + accessRegion.left * bytesPerPixel;
+    const uint64_t end = begin + (accessRegion.height - 1) * strideBytes +
+                         accessRegion.width * bytesPerPixel;
+
+    const uint64_t alignedBegin = begin & ~(kGrallocSyncAlignment - 1);
+    const uint64_t alignedEnd = (end + kGrallocSyncAlignment - 1) & ~(kGrallocSyncAlignment - 1);
+    *outRange = GrallocSyncRange{alignedBegin, alignedEnd - alignedBegin};
+    return true;
+}
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,145 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <android/hardware/graphics/mapper/3.0/IMapper.h>
+#include <hardware/gralloc.h>
+#include "MapperHal.h"
+#include "../hwcomposer/img_gralloc_common_public.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace passthrough {
+
+using hal::BufferMetadata;
+
+// where the chroma samples of an 8-bit 4:2:0 format live relative to luma
+enum class GrallocChromaLayout : uint8_t {
+    // one plane of interleaved Cb/Cr pairs after the luma plane
+    CBCR,
+    // one plane of interleaved Cr/Cb pairs after the luma plane
+    CRCB,
+    // a Cr plane and then a Cb plane after the luma plane, as in YV12
+    CR_CB_PLANAR,
+};
+
+struct GrallocYCbCrGeometry {
+    int32_t format;
+    GrallocChromaLayout chromaLayout;
+};
+
+namespace detail {
+
+// UYVY is not listed: it is packed 4:2:2 with a luma step of 2, and
+// YCbCrLayout has no way to express a luma step other than 1.
+constexpr GrallocYCbCrGeometry kGrallocYCbCrGeometries[] = {
+    {HAL_PIXEL_FORMAT_NV12, GrallocChromaLayout::CBCR},
+    {HAL_PIXEL_FORMAT_NV12_CUSTOM, GrallocChromaLayout::CBCR},
+    {HAL_PIXEL_FORMAT_NV21, GrallocChromaLayout::CRCB},
+    {HAL_PIXEL_FORMAT_NV21_CUSTOM, GrallocChromaLayout::CRCB},
+    {HAL_PIXEL_FORMAT_YV12, GrallocChromaLayout::CR_CB_PLANAR},
+};
+
+}  // namespace detail
+
+constexpr const GrallocYCbCrGeometry* grallocGetYCbCrGeometry(int32_t format) {
+    for (const GrallocYCbCrGeometry& geometry : detail::kGrallocYCbCrGeometries) {
+        if (geometry.format == format) {
+            return &geometry;
+        }
+    }
+    return nullptr;
+}
+
+namespace detail {
+
+// The offset of a chroma plane: the one recorded in the handle, or else the
+// end of the previous plane, rows rows of stride bytes after its start.
+inline uint64_t grallocGetChromaPlaneOffset(const BufferMetadata& metadata, uint32_t plane,
+                                            uint64_t previousOffset, uint32_t stride,
+                                            uint32_t rows) {
+    if (metadata.planeOffset[plane]) {
+        return metadata.planeOffset[plane];
+    }
+    const uint32_t vStride = metadata.planeVStride[plane - 1];
+    return previousOffset + static_cast<uint64_t>(stride) * (vStride ? vStride : rows);
+}
+
+}  // namespace detail
+
+// Compute the YCbCrLayout of a buffer locked with a plain lock, for modules
+// that cannot describe it themselves.  data is the base address returned by
+// lock.  The chroma planes are placed at the offsets recorded in the handle.
+// Without them, each plane is assumed to follow the previous one after its
+// vertical stride, or after its visible rows when that is unknown too.
+inline bool grallocGetSoftwareYCbCrLayout(const BufferMetadata& metadata, void* data,
+                                          YCbCrLayout* outLayout) {
+    const GrallocYCbCrGeometry* geometry = grallocGetYCbCrGeometry(metadata.format);
+    if (!geometry || !metadata.planeStride[0]) {
+        return false;
+    }
+
+    uint8_t* y = static_cast<uint8_t*>(data);
+    const uint32_t yStride = metadata.planeStride[0];
+    const uint64_t chromaOffset =
+        detail::grallocGetChromaPlaneOffset(metadata, 1, 0, yStride, metadata.height);
+    uint8_t* chroma = y + chromaOffset;
+
+    switch (geometry->chromaLayout) {
+        case GrallocChromaLayout::CBCR:
+        case GrallocChromaLayout::CRCB: {
+            const uint32_t cStride = metadata.planeStride[1] ? metadata.planeStride[1] : yStride;
+            const bool cbFirst = geometry->chromaLayout == GrallocChromaLayout::CBCR;
+            outLayout->cb = cbFirst ? chroma : chroma + 1;
+            outLayout->cr = cbFirst ? chroma + 1 : chroma;
+            outLayout->cStride = cStride;
+            outLayout->chromaStep = 2;
+            break;
+        }
+        case GrallocChromaLayout::CR_CB_PLANAR: {
+            // the chroma stride of YV12 is half the luma stride, aligned to 16
+            const uint32_t cStride = metadata.planeStride[1] ? metadata.planeStride[1]
+                                                             : ((yStride / 2) + 15) & ~15u;
+            // the Cr plane of an odd-height buffer has one more row than half
+            const uint32_t cHeight = (metadata.height + 1) / 2;
+            outLayout->cr = chroma;
+            outLayout->cb = y + detail::grallocGetChromaPlaneOffset(metadata, 2, chromaOffset,
+                                                                    cStride, cHeight);
+            outLayout->cStride = cStride;
+            outLayout->chromaStep = 1;
+            break;
+        }
+    }
+
+    outLayout->y = y;
+    outLayout->yStride = yStride;
+    return true;
+}
+
+}  // namespace passthrough
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -17,6 +17,14 @@
 #define LOG_TAG "android.hardware.graphics.mapper@3.0-impl"
 
 #include "Mapper.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include <sync/sync.h>
+
 #include "GrallocLoader.h"
 #include "../hwcomposer/img_gralloc_common_public.h"
 
@@ -30,7 +38,58 @@ namespace hal {
 
 namespace detail {
 
-Return<void> Mapper::createDescriptor(const V3_0::IMapper::BufferDescriptorInfo& description,
+namespace {
+
+// number of the longest-lived buffers listed by debug()
+constexpr size_t kDumpedBuffers = 32;
+
+// drop a release fence that has signaled already, so that the client gets
+// no fence to wait on
+void elideSignaledFence(base::unique_fd* fenceFd) {
+    if (*fenceFd >= 0 && sync_wait(*fenceFd, 0) == 0) {
+        fenceFd->reset();
+    }
+}
+
+// Merge the pending release fences of a batch into a single fence, which
+// is then returned for every buffer of the batch.  Returns false, leaving
+// the fences alone, when there is nothing to merge or the kernel fails to
+// merge them.
+bool mergeFences(std::vector<base::unique_fd>* fenceFds) {
+    const size_t pending = std::count_if(fenceFds->begin(), fenceFds->end(),
+                                         [](const base::unique_fd& fenceFd) { return fenceFd >= 0; });
+    if (pending < 2) {
+        return false;
+    }
+
+    int first = -1;
+    base::unique_fd merged;
+    for (const base::unique_fd& fenceFd : *fenceFds) {
+        if (fenceFd < 0) {
+            continue;
+        }
+
+        if (first < 0) {
+            first = fenceFd;
+            continue;
+        }
+
+        merged.reset(sync_merge("mapper_unlock", merged >= 0 ? merged.get() : first, fenceFd));
+        if (merged < 0) {
+            ALOGW("failed to merge release fences: %s", strerror(errno));
+            return false;
+        }
+    }
+
+    fenceFds->clear();
+    fenceFds->push_back(std::move(merged));
+    return true;
+}
+
+}  // namespace
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::createDescriptor(const V3_0::IMapper::BufferDescriptorInfo& description,
                                   IMapper::createDescriptor_cb _hidl_cb) {
         BufferDescriptor descriptor;
         Error error = mHal->createDescriptor(description, &descriptor);
@@ -38,8 +97,11 @@ Return<void> Mapper::createDescriptor(const V3_0::IMapper::BufferDescriptorInfo&
         return Void();
     }
 
-Return<void> Mapper::importBuffer(const hidl_handle& rawHandle,
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::importBuffer(const hidl_handle& rawHandle,
                           IMapper::importBuffer_cb _hidl_cb) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::IMPORT);
+
     if (!rawHandle.getNativeHandle()) {
         _hidl_cb(Error::BAD_BUFFER, nullptr);
         return Void();
@@ -52,125 +114,723 @@ Return<void> Mapper::importBuffer(const hidl_handle& rawHandle,
         return Void();
     }
 
-    void* buffer = addImportedBuffer(bufferHandle);
-    if (!buffer) {
+    // the module only knows the handle registered for the buffer
+    native_handle_t* registeredHandle = mHal->getRegisteredHandle(bufferHandle);
+
+    BufferMetadata metadata;
+    error = mHal->getBufferMetadata(registeredHandle, &metadata);
+    if (error != Error::NONE) {
         mHal->freeBuffer(bufferHandle);
-        _hidl_cb(Error::NO_RESOURCES, nullptr);
+        _hidl_cb(error, nullptr);
         return Void();
     }
 
+    void* buffer = addImportedBuffer(bufferHandle, registeredHandle, metadata);
+    MapperStats::add(MapperStats::Counter::IMPORTED_BUFFERS, 1);
+
     _hidl_cb(error, buffer);
     return Void();
 }
 
-Return<Error> Mapper::freeBuffer(void* buffer) {
-    native_handle_t* bufferHandle = removeImportedBuffer(buffer);
-    if (!bufferHandle) {
+template <typename Hal, typename BufferPool>
+Return<Error> MapperImpl<Hal, BufferPool>::freeBuffer(void* buffer) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::FREE);
+
+    native_handle_t* bufferHandle = nullptr;
+    if (!removeImportedBuffer(buffer, &bufferHandle)) {
         return Error::BAD_BUFFER;
     }
 
-    return mHal->freeBuffer(bufferHandle);
+    MapperStats::add(MapperStats::Counter::IMPORTED_BUFFERS, -1);
+    // a pinned buffer is freed once it is unpinned
+    return bufferHandle ? mHal->freeBuffer(bufferHandle) : Error::NONE;
 }
 
-Return<Error> Mapper::validateBufferSize(void* buffer,
+template <typename Hal, typename BufferPool>
+Return<Error> MapperImpl<Hal, BufferPool>::validateBufferSize(void* buffer,
                                  const IMapper::BufferDescriptorInfo& description,
                                  uint32_t stride) {
-    const native_handle_t* bufferHandle = getImportedBuffer(buffer);
-    if (!bufferHandle) {
+    const ImportedBuffer* importedBuffer = getImportedBuffer(buffer);
+    if (!importedBuffer) {
         return Error::BAD_BUFFER;
     }
 
-    return mHal->validateBufferSize(bufferHandle, description, stride);
+    return mHal->validateBufferSize(importedBuffer->handle, description, stride);
 }
 
-Return<void> Mapper::getTransportSize(void* buffer, IMapper::getTransportSize_cb _hidl_cb) {
-    const native_handle_t* bufferHandle = getImportedBuffer(buffer);
-    if (!bufferHandle) {
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::getTransportSize(void* buffer, IMapper::getTransportSize_cb _hidl_cb) {
+    const ImportedBuffer* importedBuffer = getImportedBuffer(buffer);
+    if (!importedBuffer) {
         _hidl_cb(Error::BAD_BUFFER, 0, 0);
         return Void();
     }
 
     uint32_t numFds = 0;
     uint32_t numInts = 0;
-    Error error = mHal->getTransportSize(bufferHandle, &numFds, &numInts);
+    Error error = mHal->getTransportSize(importedBuffer->handle, &numFds, &numInts);
     _hidl_cb(error, numFds, numInts);
     return Void();
 }
 
-Return<void> Mapper::lock(void* buffer, uint64_t cpuUsage, const V3_0::IMapper::Rect& accessRegion,
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::lock(void* buffer, uint64_t cpuUsage, const V3_0::IMapper::Rect& accessRegion,
                   const hidl_handle& acquireFence, IMapper::lock_cb _hidl_cb) {
-    const native_handle_t* bufferHandle = getImportedBuffer(buffer);
-    if (!bufferHandle) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::LOCK);
+
+    const ImportedBuffer* importedBuffer = getImportedBuffer(buffer);
+    if (!importedBuffer) {
         _hidl_cb(Error::BAD_BUFFER, nullptr, -1, -1);
         return Void();
     }
 
     base::unique_fd fenceFd;
-    Error error = getFenceFd(acquireFence, &fenceFd);
+    Error error = getFenceFd(acquireFence, &fenceFd, mHal->waitsForAcquireFence());
     if (error != Error::NONE) {
         _hidl_cb(error, nullptr, -1, -1);
         return Void();
     }
 
     void* data = nullptr;
-    error = mHal->lock(bufferHandle, cpuUsage, accessRegion, std::move(fenceFd), &data);
+    YCbCrLayout layout{};
+    bool shared = false;
+    BufferLockState& lockState = importedBuffer->lockState;
+    error = lockState.beginLock(cpuUsage, accessRegion, BufferLockState::Mapping::DATA, true,
+                                &data, &layout, &shared);
     if (error == Error::NONE) {
-        const IMG_native_handle_t* imgHnd2 = reinterpret_cast<const IMG_native_handle_t*>(bufferHandle);
-        _hidl_cb(error, data, imgHnd2->uiBpp >> 3, imgHnd2->uiBpp >> 3);
+        if (shared) {
+            error = waitFenceFd(fenceFd);
+            if (error != Error::NONE) {
+                bool vendorUnlock = false;
+                bool cached = false;
+                lockState.beginUnlock(&vendorUnlock, &cached);
+            }
+        } else {
+            // the mapping cache is only tried once the fence has signaled
+            bool cached = false;
+            if (fenceFd < 0) {
+                data = mHal->lockCached(importedBuffer->handle, cpuUsage, accessRegion);
+                cached = data != nullptr;
+            }
+            if (!cached) {
+                error = mHal->lock(importedBuffer->handle, cpuUsage, accessRegion,
+                                   std::move(fenceFd), &data);
+            }
+            lockState.endLock(cpuUsage, accessRegion, BufferLockState::Mapping::DATA, error,
+                              data, layout, cached);
+        }
+    }
+
+    if (error == Error::NONE) {
+        MapperStats::add(MapperStats::Counter::LOCKED_BUFFERS, 1);
+        const int32_t bytesPerPixel = importedBuffer->metadata.bytesPerPixel;
+        _hidl_cb(error, data, bytesPerPixel, bytesPerPixel);
     } else {
         _hidl_cb(error, data, -1, -1);
     }
     return Void();
 }
 
-Return<void> Mapper::lockYCbCr(void* buffer, uint64_t cpuUsage, const V3_0::IMapper::Rect& accessRegion,
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::lockYCbCr(void* buffer, uint64_t cpuUsage, const V3_0::IMapper::Rect& accessRegion,
                        const hidl_handle& acquireFence,
                        IMapper::lockYCbCr_cb _hidl_cb) {
-    const native_handle_t* bufferHandle = getImportedBuffer(buffer);
-    if (!bufferHandle) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::LOCK_YCBCR);
+
+    const ImportedBuffer* importedBuffer = getImportedBuffer(buffer);
+    if (!importedBuffer) {
         _hidl_cb(Error::BAD_BUFFER, YCbCrLayout{});
         return Void();
     }
 
     base::unique_fd fenceFd;
-    Error error = getFenceFd(acquireFence, &fenceFd);
+    Error error = getFenceFd(acquireFence, &fenceFd, mHal->waitsForAcquireFence());
     if (error != Error::NONE) {
         _hidl_cb(error, YCbCrLayout{});
         return Void();
     }
 
+    void* data = nullptr;
     YCbCrLayout layout{};
-    error = mHal->lockYCbCr(bufferHandle, cpuUsage, accessRegion, std::move(fenceFd), &layout);
+    bool shared = false;
+    BufferLockState& lockState = importedBuffer->lockState;
+    error = lockState.beginLock(cpuUsage, accessRegion, BufferLockState::Mapping::YCBCR, true,
+                                &data, &layout, &shared);
+    if (error == Error::NONE) {
+        if (shared) {
+            error = waitFenceFd(fenceFd);
+            if (error != Error::NONE) {
+                bool vendorUnlock = false;
+                bool cached = false;
+                lockState.beginUnlock(&vendorUnlock, &cached);
+            }
+        } else {
+            error = mHal->lockYCbCr(importedBuffer->handle, importedBuffer->metadata, cpuUsage,
+                                    accessRegion, std::move(fenceFd), &layout);
+            lockState.endLock(cpuUsage, accessRegion, BufferLockState::Mapping::YCBCR, error,
+                              data, layout, false);
+        }
+    }
+
+    if (error == Error::NONE) {
+        MapperStats::add(MapperStats::Counter::LOCKED_BUFFERS, 1);
+    }
     _hidl_cb(error, layout);
     return Void();
 }
 
-Return<void> Mapper::unlock(void* buffer, IMapper::unlock_cb _hidl_cb) {
-    const native_handle_t* bufferHandle = getImportedBuffer(buffer);
-    if (!bufferHandle) {
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::unlock(void* buffer, IMapper::unlock_cb _hidl_cb) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::UNLOCK);
+
+    const ImportedBuffer* importedBuffer = getImportedBuffer(buffer);
+    if (!importedBuffer) {
         _hidl_cb(Error::BAD_BUFFER, nullptr);
         return Void();
     }
 
-    base::unique_fd fenceFd;
-    Error error = mHal->unlock(bufferHandle, &fenceFd);
+    bool vendorUnlock = false;
+    bool cached = false;
+    Error error = importedBuffer->lockState.beginUnlock(&vendorUnlock, &cached);
     if (error != Error::NONE) {
         _hidl_cb(error, nullptr);
         return Void();
     }
 
+    MapperStats::add(MapperStats::Counter::LOCKED_BUFFERS, -1);
+
+    // readers sharing a mapping have nothing to release
+    base::unique_fd fenceFd;
+    if (vendorUnlock && cached) {
+        mHal->unlockCached(importedBuffer->handle);
+    } else if (vendorUnlock) {
+        error = mHal->unlock(importedBuffer->handle, &fenceFd);
+        if (error != Error::NONE) {
+            _hidl_cb(error, nullptr);
+            return Void();
+        }
+        elideSignaledFence(&fenceFd);
+    }
+
     NATIVE_HANDLE_DECLARE_STORAGE(fenceStorage, 1, 0);
     _hidl_cb(error, getFenceHandle(fenceFd, fenceStorage));
     return Void();
 }
 
-Return<void> Mapper::isSupported(const ::android::hardware::graphics::mapper::V3_0::IMapper::BufferDescriptorInfo& description,
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::isSupported(const ::android::hardware::graphics::mapper::V3_0::IMapper::BufferDescriptorInfo& description,
                                     isSupported_cb _hidl_cb) {
     _hidl_cb(Error::NONE, mHal->isSupported(description));
     return Void();
 }
 
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::isSupportedBatch(const hidl_vec<IMapper::BufferDescriptorInfo>& descriptions,
+                                      isSupportedBatch_cb _hidl_cb) {
+    hidl_vec<bool> supported;
+    mHal->isSupportedBatch(descriptions, &supported);
+    _hidl_cb(Error::NONE, supported);
+    return Void();
+}
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::importBuffers(const hidl_vec<hidl_handle>& rawHandles,
+                                   importBuffers_cb _hidl_cb) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::IMPORT);
+
+    const size_t count = rawHandles.size();
+
+    std::vector<const native_handle_t*> halRawHandles(count);
+    for (size_t i = 0; i < count; i++) {
+        halRawHandles[i] = rawHandles[i].getNativeHandle();
+        if (!halRawHandles[i]) {
+            _hidl_cb(Error::BAD_BUFFER, hidl_vec<void*>());
+            return Void();
+        }
+    }
+
+    std::vector<native_handle_t*> bufferHandles;
+    Error error = mHal->importBuffers(halRawHandles, &bufferHandles);
+    if (error != Error::NONE) {
+        _hidl_cb(error, hidl_vec<void*>());
+        return Void();
+    }
+
+    std::vector<native_handle_t*> registeredHandles(count);
+    std::vector<BufferMetadata> metadata(count);
+    for (size_t i = 0; i < count && error == Error::NONE; i++) {
+        registeredHandles[i] = mHal->getRegisteredHandle(bufferHandles[i]);
+        error = mHal->getBufferMetadata(registeredHandles[i], &metadata[i]);
+    }
+
+    if (error != Error::NONE) {
+        mHal->freeBuffers(bufferHandles);
+        _hidl_cb(error, hidl_vec<void*>());
+        return Void();
+    }
+
+    hidl_vec<void*> buffers(count);
+    addImportedBuffers(bufferHandles.data(), registeredHandles.data(), metadata.data(), count,
+                       buffers.data());
+
+    MapperStats::add(MapperStats::Counter::IMPORTED_BUFFERS, count);
+    _hidl_cb(error, buffers);
+    return Void();
+}
+
+template <typename Hal, typename BufferPool>
+Return<Error> MapperImpl<Hal, BufferPool>::freeBuffers(const hidl_vec<void*>& buffers) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::FREE);
+
+    std::vector<native_handle_t*> bufferHandles(buffers.size());
+    const size_t removed =
+        removeImportedBuffers(buffers.data(), buffers.size(), bufferHandles.data());
+
+    bufferHandles.erase(std::remove(bufferHandles.begin(), bufferHandles.end(), nullptr),
+                        bufferHandles.end());
+    MapperStats::add(MapperStats::Counter::IMPORTED_BUFFERS, -static_cast<int64_t>(removed));
+
+    Error error = mHal->freeBuffers(bufferHandles);
+    return removed != buffers.size() ? Error::BAD_BUFFER : error;
+}
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::lockAsync(void* buffer, uint64_t cpuUsage,
+                               const IMapper::Rect& accessRegion,
+                               const hidl_handle& acquireFence, lockAsync_cb _hidl_cb) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::LOCK);
+
+    // the buffer stays pinned until the callback has run, so that neither
+    // its entry nor its handle goes away when the client frees it while the
+    // lock waits for the fence
+    const ImportedBuffer* importedBuffer = pinImportedBuffer(buffer);
+    if (!importedBuffer) {
+        _hidl_cb(Error::BAD_BUFFER, nullptr, -1, -1);
+        return Void();
+    }
+
+    base::unique_fd fenceFd;
+    Error error = getFenceFd(acquireFence, &fenceFd);
+    if (error != Error::NONE) {
+        unpinImportedBuffer(buffer);
+        _hidl_cb(error, nullptr, -1, -1);
+        return Void();
+    }
+
+    // async locks never share a mapping, as that would mean waiting for
+    // the fence here
+    void* data = nullptr;
+    YCbCrLayout layout{};
+    bool shared = false;
+    error = importedBuffer->lockState.beginLock(cpuUsage, accessRegion,
+                                                BufferLockState::Mapping::DATA, false, &data,
+                                                &layout, &shared);
+    if (error != Error::NONE) {
+        unpinImportedBuffer(buffer);
+        _hidl_cb(error, nullptr, -1, -1);
+        return Void();
+    }
+
+    // nothing to wait for when the fence has signaled already and the
+    // mapping cache can serve the lock
+    if (passthrough::grallocIsFenceSignaled(fenceFd)) {
+        data = mHal->lockCached(importedBuffer->handle, cpuUsage, accessRegion);
+        if (data) {
+            importedBuffer->lockState.endLock(cpuUsage, accessRegion,
+                                              BufferLockState::Mapping::DATA, Error::NONE, data,
+                                              YCbCrLayout{}, true);
+            MapperStats::add(MapperStats::Counter::LOCKED_BUFFERS, 1);
+            const int32_t bytesPerPixel = importedBuffer->metadata.bytesPerPixel;
+            _hidl_cb(Error::NONE, data, bytesPerPixel, bytesPerPixel);
+            unpinImportedBuffer(buffer);
+            return Void();
+        }
+    }
+
+    mHal->lockAsync(importedBuffer->handle, cpuUsage, accessRegion, std::move(fenceFd),
+                    [this, buffer, importedBuffer, cpuUsage, accessRegion, _hidl_cb](Error error,
+                                                                                    void* data) {
+                        importedBuffer->lockState.endLock(cpuUsage, accessRegion,
+                                                          BufferLockState::Mapping::DATA, error,
+                                                          data, YCbCrLayout{}, false);
+                        if (error == Error::NONE) {
+                            const int32_t bytesPerPixel = importedBuffer->metadata.bytesPerPixel;
+                            MapperStats::add(MapperStats::Counter::LOCKED_BUFFERS, 1);
+                            _hidl_cb(error, data, bytesPerPixel, bytesPerPixel);
+                        } else {
+                            _hidl_cb(error, data, -1, -1);
+                        }
+                        unpinImportedBuffer(buffer);
+                    });
+    return Void();
+}
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::lockBatch(const hidl_vec<BufferLockRequest>& requests,
+                               lockBatch_cb _hidl_cb) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::LOCK);
+
+    const size_t count = requests.size();
+
+    std::vector<void*> buffers(count);
+    for (size_t i = 0; i < count; i++) {
+        buffers[i] = requests[i].buffer;
+    }
+
+    std::vector<const ImportedBuffer*> importedBuffers(count);
+    if (!getImportedBuffers(buffers.data(), count, importedBuffers.data())) {
+        _hidl_cb(Error::BAD_BUFFER, hidl_vec<BufferLockResult>());
+        return Void();
+    }
+
+    std::vector<hal::LockRequest> halRequests(count);
+    for (size_t i = 0; i < count; i++) {
+        hal::LockRequest& halRequest = halRequests[i];
+        halRequest.bufferHandle = importedBuffers[i]->handle;
+        halRequest.metadata = &importedBuffers[i]->metadata;
+        halRequest.cpuUsage = requests[i].cpuUsage;
+        halRequest.accessRegion = requests[i].accessRegion;
+
+        Error error = getFenceFd(requests[i].acquireFence, &halRequest.fenceFd);
+        if (error != Error::NONE) {
+            _hidl_cb(error, hidl_vec<BufferLockResult>());
+            return Void();
+        }
+    }
+
+    // batched locks never share a mapping; a conflicting lock fails the
+    // whole batch before the vendor module is involved
+    std::vector<void*> data;
+    for (size_t i = 0; i < count; i++) {
+        void* sharedData = nullptr;
+        YCbCrLayout layout{};
+        bool shared = false;
+        Error error = importedBuffers[i]->lockState.beginLock(
+                requests[i].cpuUsage, requests[i].accessRegion, BufferLockState::Mapping::DATA,
+                false, &sharedData, &layout, &shared);
+        if (error != Error::NONE) {
+            while (i-- > 0) {
+                importedBuffers[i]->lockState.endLock(requests[i].cpuUsage,
+                                                      requests[i].accessRegion,
+                                                      BufferLockState::Mapping::DATA, error,
+                                                      nullptr, layout, false);
+            }
+            _hidl_cb(error, hidl_vec<BufferLockResult>());
+            return Void();
+        }
+    }
+
+    Error error = mHal->lockBatch(&halRequests, &data);
+    for (size_t i = 0; i < count; i++) {
+        importedBuffers[i]->lockState.endLock(
+                requests[i].cpuUsage, requests[i].accessRegion, BufferLockState::Mapping::DATA,
+                error, error == Error::NONE ? data[i] : nullptr, YCbCrLayout{}, false);
+    }
+    if (error != Error::NONE) {
+        _hidl_cb(error, hidl_vec<BufferLockResult>());
+        return Void();
+    }
+
+    MapperStats::add(MapperStats::Counter::LOCKED_BUFFERS, count);
+
+    hidl_vec<BufferLockResult> results(count);
+    for (size_t i = 0; i < count; i++) {
+        const int32_t bytesPerPixel = importedBuffers[i]->metadata.bytesPerPixel;
+        results[i] = BufferLockResult{data[i], bytesPerPixel, bytesPerPixel};
+    }
+
+    _hidl_cb(error, results);
+    return Void();
+}
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::unlockBatch(const hidl_vec<void*>& buffers, unlockBatch_cb _hidl_cb) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::UNLOCK);
+
+    const size_t count = buffers.size();
+
+    std::vector<const ImportedBuffer*> importedBuffers(count);
+    if (!getImportedBuffers(buffers.data(), count, importedBuffers.data())) {
+        _hidl_cb(Error::BAD_BUFFER, hidl_vec<hidl_handle>());
+        return Void();
+    }
+
+    // only buffers whose last vendor lock goes away are passed on to the
+    // vendor module; locks of the mapping cache are released right away
+    Error error = Error::NONE;
+    size_t unlocked = 0;
+    std::vector<size_t> vendorIndices;
+    std::vector<const native_handle_t*> bufferHandles;
+    for (size_t i = 0; i < count; i++) {
+        bool vendorUnlock = false;
+        bool cached = false;
+        Error lockStateError = importedBuffers[i]->lockState.beginUnlock(&vendorUnlock, &cached);
+        if (lockStateError != Error::NONE) {
+            if (error == Error::NONE) {
+                error = lockStateError;
+            }
+            continue;
+        }
+
+        unlocked++;
+        if (vendorUnlock && cached) {
+            mHal->unlockCached(importedBuffers[i]->handle);
+        } else if (vendorUnlock) {
+            vendorIndices.push_back(i);
+            bufferHandles.push_back(importedBuffers[i]->handle);
+        }
+    }
+
+    std::vector<base::unique_fd> vendorFenceFds;
+    Error vendorError = Error::NONE;
+    if (!bufferHandles.empty()) {
+        vendorError = mHal->unlockBatch(bufferHandles, &vendorFenceFds);
+    }
+    // unlockBatch unlocks every buffer even when it fails
+    MapperStats::add(MapperStats::Counter::LOCKED_BUFFERS, -static_cast<int64_t>(unlocked));
+    if (error == Error::NONE) {
+        error = vendorError;
+    }
+    if (error != Error::NONE) {
+        _hidl_cb(error, hidl_vec<hidl_handle>());
+        return Void();
+    }
+
+    for (base::unique_fd& fenceFd : vendorFenceFds) {
+        elideSignaledFence(&fenceFd);
+    }
+
+    // Every buffer of the batch gets the merged fence when the pending
+    // fences could be merged, and its own fence otherwise.
+    hidl_vec<hidl_handle> releaseFences(count);
+    if (mergeFences(&vendorFenceFds)) {
+        NATIVE_HANDLE_DECLARE_STORAGE(fenceStorage, 1, 0);
+        const hidl_handle releaseFence = getFenceHandle(vendorFenceFds[0], fenceStorage);
+        for (size_t i : vendorIndices) {
+            releaseFences[i] = releaseFence;
+        }
+
+        _hidl_cb(error, releaseFences);
+        return Void();
+    }
+
+    struct FenceStorage {
+        NATIVE_HANDLE_DECLARE_STORAGE(storage, 1, 0);
+    };
+    std::vector<FenceStorage> fenceStorage(vendorIndices.size());
+    for (size_t i = 0; i < vendorIndices.size(); i++) {
+        releaseFences[vendorIndices[i]] =
+                getFenceHandle(vendorFenceFds[i], fenceStorage[i].storage);
+    }
+
+    _hidl_cb(error, releaseFences);
+    return Void();
+}
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::lockConvert(void* buffer, const IMapper::Rect& accessRegion,
+                                 const hidl_handle& acquireFence,
+                                 common::V1_2::PixelFormat dstFormat, void* dst,
+                                 uint32_t dstStride, lockConvert_cb _hidl_cb) {
+    MapperStats::ScopedTimer timer(MapperStats::Op::LOCK_CONVERT);
+
+    const ImportedBuffer* importedBuffer = getImportedBuffer(buffer);
+    if (!importedBuffer) {
+        _hidl_cb(Error::BAD_BUFFER, nullptr);
+        return Void();
+    }
+
+    const BufferMetadata& metadata = importedBuffer->metadata;
+    const bool uyvy = metadata.format == HAL_PIXEL_FORMAT_UYVY;
+    const bool ycbcr = !uyvy && metadata.formatClass == BufferMetadata::FormatClass::YUV;
+    const int32_t format = static_cast<int32_t>(dstFormat);
+    if ((ycbcr || uyvy) ? format != HAL_PIXEL_FORMAT_RGBA_8888
+                        : format != metadata.format || metadata.numPlanes != 1 ||
+                              !metadata.bytesPerPixel) {
+        ALOGE("cannot convert format 0x%x to 0x%x", metadata.format, format);
+        _hidl_cb(Error::UNSUPPORTED, nullptr);
+        return Void();
+    }
+
+    const uint32_t dstBytesPerPixel = (ycbcr || uyvy) ? 4 : metadata.bytesPerPixel;
+    if (!dst || accessRegion.left < 0 || accessRegion.top < 0 || accessRegion.width <= 0 ||
+        accessRegion.height <= 0 ||
+        static_cast<uint64_t>(accessRegion.left) + accessRegion.width > metadata.width ||
+        static_cast<uint64_t>(accessRegion.top) + accessRegion.height > metadata.height ||
+        static_cast<uint64_t>(accessRegion.width) * dstBytesPerPixel > dstStride) {
+        ALOGE("invalid region or destination for conversion");
+        _hidl_cb(Error::BAD_VALUE, nullptr);
+        return Void();
+    }
+
+    // go through lock and lockYCbCr, so that the fence and the lock state
+    // are handled as for any other lock
+    const uint64_t cpuUsage = static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN);
+    Error error = Error::NONE;
+    if (ycbcr) {
+        lockYCbCr(buffer, cpuUsage, accessRegion, acquireFence,
+                  [&](Error tmpError, const YCbCrLayout& layout) {
+                      error = tmpError;
+                      if (error == Error::NONE) {
+                          convertYCbCrToRgba(layout, accessRegion, dst, dstStride);
+                      }
+                  });
+    } else {
+        lock(buffer, cpuUsage, accessRegion, acquireFence,
+             [&](Error tmpError, void* data, int32_t /*bytesPerPixel*/,
+                 int32_t /*bytesPerStride*/) {
+                 error = tmpError;
+                 if (error != Error::NONE) {
+                     return;
+                 }
+
+                 const uint32_t strideBytes = metadata.planeStride[0] * metadata.bytesPerPixel;
+                 if (uyvy) {
+                     convertUyvyToRgba(data, strideBytes, accessRegion, dst, dstStride);
+                 } else {
+                     copyRegion(data, strideBytes, metadata.bytesPerPixel, accessRegion, dst,
+                                dstStride);
+                 }
+             });
+    }
+
+    if (error != Error::NONE) {
+        _hidl_cb(error, nullptr);
+        return Void();
+    }
+
+    return unlock(buffer, _hidl_cb);
+}
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::readback(void* buffer, const IMapper::Rect& accessRegion,
+                              const hidl_handle& acquireFence, void* dst, uint32_t dstStride,
+                              readback_cb _hidl_cb) {
+    const ImportedBuffer* importedBuffer = getImportedBuffer(buffer);
+    if (!importedBuffer) {
+        _hidl_cb(Error::BAD_BUFFER, nullptr);
+        return Void();
+    }
+
+    const BufferMetadata& metadata = importedBuffer->metadata;
+    if (metadata.numPlanes != 1 || !metadata.bytesPerPixel) {
+        ALOGE("cannot read back format 0x%x", metadata.format);
+        _hidl_cb(Error::UNSUPPORTED, nullptr);
+        return Void();
+    }
+
+    const size_t rowBytes = static_cast<size_t>(accessRegion.width) * metadata.bytesPerPixel;
+    if (!dst || accessRegion.left < 0 || accessRegion.top < 0 || accessRegion.width <= 0 ||
+        accessRegion.height <= 0 ||
+        static_cast<uint64_t>(accessRegion.left) + accessRegion.width > metadata.width ||
+        static_cast<uint64_t>(accessRegion.top) + accessRegion.height > metadata.height ||
+        rowBytes > dstStride) {
+        ALOGE("invalid region or destination for readback");
+        _hidl_cb(Error::BAD_VALUE, nullptr);
+        return Void();
+    }
+
+    const uint64_t cpuUsage = static_cast<uint64_t>(BufferUsage::CPU_READ_OFTEN);
+    void* data = nullptr;
+    Error error = Error::NONE;
+    lock(buffer, cpuUsage, accessRegion, acquireFence,
+         [&](Error tmpError, void* tmpData, int32_t /*bytesPerPixel*/,
+             int32_t /*bytesPerStride*/) {
+             error = tmpError;
+             data = tmpData;
+         });
+    if (error != Error::NONE) {
+        _hidl_cb(error, nullptr);
+        return Void();
+    }
+
+    const size_t strideBytes = static_cast<size_t>(metadata.planeStride[0]) * metadata.bytesPerPixel;
+    const uint8_t* src = static_cast<const uint8_t*>(data) + accessRegion.top * strideBytes +
+                         static_cast<size_t>(accessRegion.left) * metadata.bytesPerPixel;
+
+    // Unlock the buffer.  The client only learns about the outcome, so the
+    // release fence is waited for, or returned when it is still pending.
+    auto unlockBuffer = [this, buffer](base::unique_fd* outReleaseFenceFd) {
+        Error unlockError = Error::NONE;
+        unlock(buffer, [&](Error tmpError, const hidl_handle& releaseFence) {
+            unlockError = tmpError;
+            if (!releaseFence.getNativeHandle() || releaseFence->numFds != 1 ||
+                passthrough::grallocIsFenceSignaled(releaseFence->data[0])) {
+                return;
+            }
+            if (outReleaseFenceFd) {
+                outReleaseFenceFd->reset(dup(releaseFence->data[0]));
+            }
+            if (!outReleaseFenceFd || *outReleaseFenceFd < 0) {
+                waitFenceFd(releaseFence->data[0]);
+            }
+        });
+        return unlockError;
+    };
+
+    base::unique_fd completionFd;
+    if (rowBytes * accessRegion.height >= BufferCopyEngine::kParallelThreshold) {
+        // The buffer is unlocked by whichever worker finishes last.  A
+        // pending release fence is left to the fence waiter, which signals
+        // the completion event once it fires, so that no worker blocks.
+        completionFd = BufferCopyEngine::getInstance().copy(
+            src, strideBytes, dst, dstStride, rowBytes, accessRegion.height,
+            [unlockBuffer](base::unique_fd copyCompletionFd) {
+                base::unique_fd releaseFenceFd;
+                const bool ok = unlockBuffer(&releaseFenceFd) == Error::NONE;
+                auto sharedCompletionFd =
+                    std::make_shared<base::unique_fd>(std::move(copyCompletionFd));
+                passthrough::GrallocFenceWaiter::getInstance().waitAsync(
+                    std::move(releaseFenceFd), [sharedCompletionFd, ok]() {
+                        BufferCopyEngine::signalCompletion(*sharedCompletionFd, ok);
+                    });
+            });
+    }
+
+    if (completionFd < 0) {
+        for (int32_t row = 0; row < accessRegion.height; row++) {
+            memcpy(static_cast<uint8_t*>(dst) + row * static_cast<size_t>(dstStride),
+                   src + row * strideBytes, rowBytes);
+        }
+        _hidl_cb(unlockBuffer(nullptr), nullptr);
+        return Void();
+    }
+
+    NATIVE_HANDLE_DECLARE_STORAGE(eventStorage, 1, 0);
+    _hidl_cb(Error::NONE, getFenceHandle(completionFd, eventStorage));
+    return Void();
+}
+
+template <typename Hal, typename BufferPool>
+Return<void> MapperImpl<Hal, BufferPool>::debug(const hidl_handle& fd, const hidl_vec<hidl_string>& /*options*/) {
+    if (!fd.getNativeHandle() || fd->numFds < 1) {
+        return Void();
+    }
+
+    const std::string dump =
+        MapperStats::dump() + BufferPool::getInstance().getTracker().dump(kDumpedBuffers);
+    const char* data = dump.c_str();
+    size_t remaining = dump.size();
+    while (remaining) {
+        ssize_t written = TEMP_FAILURE_RETRY(write(fd->data[0], data, remaining));
+        if (written <= 0) {
+            break;
+        }
+        data += written;
+        remaining -= written;
+    }
+
+    return Void();
+}
+
+template class MapperImpl<passthrough::Gralloc0SyncHal,
+                          passthrough::GrallocImportedBufferPool>;
+template class MapperImpl<passthrough::Gralloc0AsyncHal,
+                          passthrough::GrallocImportedBufferPool>;
+template class MapperImpl<passthrough::Gralloc1Hal, passthrough::GrallocImportedBufferPool>;
+
 }  // namespace detail
+
 extern "C" IMapper* HIDL_FETCH_IMapper(const char* /*name*/) {
       return passthrough::GrallocLoader::load();
 }
@@ -20,11 +20,22 @@
 #warning "Mapper.h included without LOG_TAG"
 #endif
 
+#include <errno.h>
+#include <string.h>
+
 #include <memory>
+#include <vector>
 
 #include <android/hardware/graphics/mapper/3.0/IMapper.h>
 #include <log/log.h>
+#include <sync/sync.h>
+#include "BufferConvert.h"
+#include "BufferCopyEngine.h"
+#include "BufferLockState.h"
+#include "BufferTracker.h"
+#include "GrallocFence.h"
 #include "MapperHal.h"
+#include "MapperStats.h"
 #include "../hwcomposer/img_gralloc_common_public.h"
 
 namespace android {
@@ -35,12 +46,24 @@ namespace V3_0 {
 namespace renesas {
 namespace hal {
 
+// an imported buffer handle together with the metadata cached at import time
+// and its lock state
+struct ImportedBuffer {
+    native_handle_t* handle;
+    BufferMetadata metadata;
+    mutable BufferLockState lockState;
+};
+
 namespace detail {
 
-// MapperImpl implements V3_0::IMapper on top of V3_0::hal::MapperHal
+// MapperImpl implements V3_0::IMapper on top of a V3_0::hal::MapperHal
+// implementation.  Hal is the concrete HAL class chosen when the module is
+// loaded; when it is final, calls into it are bound at compile time.
+// BufferPool manages the imported buffers and is called directly as well.
+template <typename Hal, typename BufferPool>
 class MapperImpl : public V3_0::IMapper {
 public:
-    bool init(std::unique_ptr<hal::MapperHal> hal) {
+    bool init(std::unique_ptr<Hal> hal) {
         mHal = std::move(hal);
         return true;
     }
@@ -73,22 +96,156 @@ public:
     Return<void> isSupported(const ::android::hardware::graphics::mapper::V3_0::IMapper::BufferDescriptorInfo& description,
                             isSupported_cb _hidl_cb) override;
 
+    // dump the mapper statistics, e.g. through lshal debug
+    Return<void> debug(const hidl_handle& fd, const hidl_vec<hidl_string>& options) override;
+
+    // vendor extensions, reachable by clients that load this implementation
+    // in-process
+
+    // programmatic access to the statistics printed by debug()
+    MapperStats::Snapshot getStats() const { return MapperStats::snapshot(); }
+
+    // the buffers imported by the process, and the bytes they hold
+    ImportedBufferSnapshot getImportedBufferSnapshot() const {
+        return BufferPool::getInstance().getTracker().snapshot();
+    }
+
+    using isSupportedBatch_cb = std::function<void(Error error, const hidl_vec<bool>& supported)>;
+
+    // isSupported for a list of buffer descriptions
+    Return<void> isSupportedBatch(const hidl_vec<IMapper::BufferDescriptorInfo>& descriptions,
+                                  isSupportedBatch_cb _hidl_cb);
+
+    using importBuffers_cb = std::function<void(Error error, const hidl_vec<void*>& buffers)>;
+
+    // import several raw handles, e.g. when a BufferQueue is reallocated.
+    // Either all of them are imported, or none is and the error is returned.
+    Return<void> importBuffers(const hidl_vec<hidl_handle>& rawHandles, importBuffers_cb _hidl_cb);
+
+    // Free several buffers.  Every known buffer is freed even when some of
+    // them are unknown or fail to be freed.  BAD_BUFFER is returned when
+    // any of them is unknown, and the first error of the HAL otherwise.
+    Return<Error> freeBuffers(const hidl_vec<void*>& buffers);
+
+    struct BufferLockRequest {
+        void* buffer;
+        uint64_t cpuUsage;
+        IMapper::Rect accessRegion;
+        hidl_handle acquireFence;
+    };
+
+    struct BufferLockResult {
+        void* data;
+        int32_t bytesPerPixel;
+        int32_t bytesPerStride;
+    };
+
+    using lockAsync_cb = std::function<void(Error error, void* data, int32_t bytesPerPixel,
+                                            int32_t bytesPerStride)>;
+
+    // Lock a buffer without blocking on its acquire fence.  _hidl_cb runs
+    // once the buffer is locked, either before lockAsync returns or later on
+    // a mapper worker thread.  The client may free the buffer before then;
+    // its handle is only freed once _hidl_cb has run.
+    Return<void> lockAsync(void* buffer, uint64_t cpuUsage, const IMapper::Rect& accessRegion,
+                           const hidl_handle& acquireFence, lockAsync_cb _hidl_cb);
+
+    using lockBatch_cb =
+        std::function<void(Error error, const hidl_vec<BufferLockResult>& results)>;
+    using unlockBatch_cb =
+        std::function<void(Error error, const hidl_vec<hidl_handle>& releaseFences)>;
+
+    // lock all buffers of a frame in one call.  Either all buffers are
+    // locked, or none is and the first error is returned.
+    Return<void> lockBatch(const hidl_vec<BufferLockRequest>& requests, lockBatch_cb _hidl_cb);
+
+    // unlock all buffers of a frame in one call
+    Return<void> unlockBatch(const hidl_vec<void*>& buffers, unlockBatch_cb _hidl_cb);
+
+    using lockConvert_cb = std::function<void(Error error, const hidl_handle& releaseFence)>;
+
+    // Lock accessRegion of a buffer for reading, copy it into dst and unlock
+    // the buffer again.  YCbCr buffers are converted to RGBA_8888, the only
+    // dstFormat they take; other single-plane buffers are copied to their
+    // own format.  dst receives accessRegion.width x accessRegion.height
+    // pixels, with rows dstStride bytes apart.
+    Return<void> lockConvert(void* buffer, const IMapper::Rect& accessRegion,
+                             const hidl_handle& acquireFence, common::V1_2::PixelFormat dstFormat,
+                             void* dst, uint32_t dstStride, lockConvert_cb _hidl_cb);
+
+    // completionEvent holds an eventfd, not a sync_file fence: it must not
+    // be merged with fences or handed to anything that expects one
+    using readback_cb = std::function<void(Error error, const hidl_handle& completionEvent)>;
+
+    // Copy accessRegion of a single-plane buffer into dst, with rows
+    // dstStride bytes apart.  Large regions are copied by BufferCopyEngine
+    // in the background: the buffer stays locked for reading until the copy
+    // is done, and completionEvent becomes readable once it is unlocked
+    // again and its release fence has signaled.  It then reads as BufferCopyEngine::kCompletionOk, or as
+    // kCompletionFailed when the buffer could not be unlocked.  Neither the
+    // buffer nor dst may be freed before then.  Small regions are copied
+    // and the buffer unlocked before readback returns; completionEvent is
+    // empty then and error tells whether the unlock succeeded.
+    Return<void> readback(void* buffer, const IMapper::Rect& accessRegion,
+                          const hidl_handle& acquireFence, void* dst, uint32_t dstStride,
+                          readback_cb _hidl_cb);
+
 protected:
-    // these functions can be overriden to do true imported buffer management
-    virtual void* addImportedBuffer(native_handle_t* bufferHandle) {
-        return static_cast<void*>(bufferHandle);
+    // add an imported handle, which the module knows as registeredHandle
+    void* addImportedBuffer(native_handle_t* bufferHandle, native_handle_t* registeredHandle,
+                            const BufferMetadata& metadata) {
+        return BufferPool::getInstance().add(bufferHandle, registeredHandle, metadata);
+    }
+
+    bool removeImportedBuffer(void* buffer, native_handle_t** outBufferHandle) {
+        return BufferPool::getInstance().remove(buffer, outBufferHandle);
+    }
+
+    const ImportedBuffer* getImportedBuffer(void* buffer) const {
+        return BufferPool::getInstance().get(buffer);
     }
 
-    virtual native_handle_t* removeImportedBuffer(void* buffer) {
-        return static_cast<native_handle_t*>(buffer);
+    // add several buffers at once
+    void addImportedBuffers(native_handle_t* const* bufferHandles,
+                            native_handle_t* const* registeredHandles,
+                            const BufferMetadata* metadata, size_t count, void** outBuffers) {
+        BufferPool::getInstance().addBatch(bufferHandles, registeredHandles, metadata, count,
+                                           outBuffers);
     }
 
-    virtual const native_handle_t* getImportedBuffer(void* buffer) const {
-        return static_cast<const native_handle_t*>(buffer);
+    // Remove several buffers at once and return how many were known.
+    // Unknown buffers, and pinned buffers whose handle is freed when they
+    // are unpinned, yield nullptr.
+    size_t removeImportedBuffers(void* const* buffers, size_t count,
+                                 native_handle_t** outBufferHandles) {
+        return BufferPool::getInstance().removeBatch(buffers, count, outBufferHandles);
     }
 
-    // convert fenceFd to or from hidl_handle
-    static Error getFenceFd(const hidl_handle& fenceHandle, base::unique_fd* outFenceFd) {
+    // keep a buffer imported until unpinImportedBuffer, even when the client
+    // frees it before then
+    const ImportedBuffer* pinImportedBuffer(void* buffer) {
+        return BufferPool::getInstance().pin(buffer);
+    }
+
+    void unpinImportedBuffer(void* buffer) {
+        native_handle_t* bufferHandle = BufferPool::getInstance().unpin(buffer);
+        if (bufferHandle) {
+            mHal->freeBuffer(bufferHandle);
+        }
+    }
+
+    // look up several buffers at once; fails when any of them is unknown
+    bool getImportedBuffers(void* const* buffers, size_t count,
+                            const ImportedBuffer** outImportedBuffers) const {
+        return BufferPool::getInstance().getBatch(buffers, count, outImportedBuffers);
+    }
+
+    // Convert fenceFd to or from hidl_handle.  The fence of the client is
+    // only dup'd when it is still pending and the HAL needs a fence of its
+    // own: a signaled fence, or a pending one that the HAL would only wait
+    // for (waitPending), yields no fence.
+    static Error getFenceFd(const hidl_handle& fenceHandle, base::unique_fd* outFenceFd,
+                            bool waitPending = false) {
         auto handle = fenceHandle.getNativeHandle();
         if (handle && handle->numFds > 1) {
             ALOGE("invalid fence handle with %d fds", handle->numFds);
@@ -97,9 +254,16 @@ protected:
 
         int fenceFd = (handle && handle->numFds == 1) ? handle->data[0] : -1;
         if (fenceFd >= 0) {
-            fenceFd = dup(fenceFd);
-            if (fenceFd < 0) {
-                return Error::NO_RESOURCES;
+            if (sync_wait(fenceFd, 0) == 0 ||
+                (waitPending && waitFenceFd(fenceFd) == Error::NONE)) {
+                MapperStats::add(MapperStats::Counter::ACQUIRE_FENCES_ELIDED, 1);
+                fenceFd = -1;
+            } else {
+                MapperStats::add(MapperStats::Counter::ACQUIRE_FENCES_DUPED, 1);
+                fenceFd = dup(fenceFd);
+                if (fenceFd < 0) {
+                    return Error::NO_RESOURCES;
+                }
             }
         }
 
@@ -108,6 +272,12 @@ protected:
         return Error::NONE;
     }
 
+    // block until the fence signals, with the stall warning of the HALs
+    static Error waitFenceFd(int fenceFd) {
+        return passthrough::grallocWaitFenceFd(fenceFd, "IMapper") ? Error::NONE
+                                                                   : Error::NO_RESOURCES;
+    }
+
     static hidl_handle getFenceHandle(const base::unique_fd& fenceFd, char* handleStorage) {
         native_handle_t* handle = nullptr;
         if (fenceFd >= 0) {
@@ -118,12 +288,13 @@ protected:
         return hidl_handle(handle);
     }
 
-    std::unique_ptr<hal::MapperHal> mHal;
+    std::unique_ptr<Hal> mHal;
 };
 
 }  // namespace detail
 
-using Mapper = detail::MapperImpl;
+template <typename Hal, typename BufferPool>
+using Mapper = detail::MapperImpl<Hal, BufferPool>;
 
 extern "C" IMapper* HIDL_FETCH_IMapper(const char* name);
 
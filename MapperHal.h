@@ -16,8 +16,12 @@
 
 #pragma once
 
+#include <functional>
+#include <vector>
+
 #include <android-base/unique_fd.h>
 #include <android/hardware/graphics/mapper/3.0/IMapper.h>
+#include "MapperWorkerPool.h"
 
 namespace android {
 namespace hardware {
@@ -27,6 +31,44 @@ namespace V3_0 {
 namespace renesas {
 namespace hal {
 
+// Layout information of an imported buffer.  It is derived once when the
+// buffer is imported so that the lock paths do not need to query it again.
+struct BufferMetadata {
+    static constexpr uint32_t kMaxPlanes = 3;
+
+    enum class FormatClass : uint8_t {
+        UNKNOWN,
+        RGB,
+        YUV,
+    };
+
+    int32_t format = 0;
+    FormatClass formatClass = FormatClass::UNKNOWN;
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint32_t bitsPerPixel = 0;
+    // bitsPerPixel / 8, rounded down
+    uint32_t bytesPerPixel = 0;
+    uint32_t numPlanes = 0;
+    // per-plane stride in pixels
+    uint32_t planeStride[kMaxPlanes] = {};
+    // per-plane height in rows, including the vertical padding of the
+    // allocator; 0 when unknown
+    uint32_t planeVStride[kMaxPlanes] = {};
+    // per-plane offset in bytes from the start of the buffer; 0 when
+    // unknown, except for the first plane
+    uint64_t planeOffset[kMaxPlanes] = {};
+};
+
+// one buffer of a batched lock
+struct LockRequest {
+    const native_handle_t* bufferHandle;
+    const BufferMetadata* metadata;
+    uint64_t cpuUsage;
+    IMapper::Rect accessRegion;
+    base::unique_fd fenceFd;
+};
+
 class MapperHal {
 public:
     virtual ~MapperHal() = default;
@@ -42,6 +84,74 @@ public:
     // free an imported buffer handle
     virtual Error freeBuffer(native_handle_t* bufferHandle) = 0;
 
+    // The handle the module knows an imported buffer handle by.  It is
+    // another handle when the import shares the registration of an earlier
+    // import of the same buffer, and must then be used for every call into
+    // the module.
+    virtual native_handle_t* getRegisteredHandle(native_handle_t* bufferHandle) {
+        return bufferHandle;
+    }
+
+    // Import several raw handles.  Either all of them are imported, or the
+    // ones imported so far are freed again and the first error is returned.
+    virtual Error importBuffers(const std::vector<const native_handle_t*>& rawHandles,
+                                std::vector<native_handle_t*>* outBufferHandles) {
+        const size_t count = rawHandles.size();
+        std::vector<Error> errors(count, Error::NONE);
+        outBufferHandles->assign(count, nullptr);
+
+        auto importOne = [this, &rawHandles, &errors, outBufferHandles](size_t i) {
+            errors[i] = importBuffer(rawHandles[i], &(*outBufferHandles)[i]);
+        };
+
+        if (count > 1 && canImportInParallel()) {
+            MapperWorkerPool::getInstance().run(count, importOne);
+        } else {
+            for (size_t i = 0; i < count; i++) {
+                importOne(i);
+                if (errors[i] != Error::NONE) {
+                    break;
+                }
+            }
+        }
+
+        Error firstError = Error::NONE;
+        for (size_t i = 0; i < count && firstError == Error::NONE; i++) {
+            firstError = errors[i];
+        }
+        if (firstError != Error::NONE) {
+            for (size_t i = 0; i < count; i++) {
+                if (errors[i] == Error::NONE && (*outBufferHandles)[i]) {
+                    freeBuffer((*outBufferHandles)[i]);
+                }
+                (*outBufferHandles)[i] = nullptr;
+            }
+        }
+
+        return firstError;
+    }
+
+    // free several imported buffer handles.  Every handle is freed even when
+    // some of them fail, in which case the first error is returned.
+    virtual Error freeBuffers(const std::vector<native_handle_t*>& bufferHandles) {
+        Error firstError = Error::NONE;
+        for (native_handle_t* bufferHandle : bufferHandles) {
+            Error error = freeBuffer(bufferHandle);
+            if (error != Error::NONE && firstError == Error::NONE) {
+                firstError = error;
+            }
+        }
+
+        return firstError;
+    }
+
+    // whether importBuffers may call into the module from several threads
+    virtual bool canImportInParallel() const { return false; }
+
+    // describe the layout of an imported buffer handle
+    virtual Error getBufferMetadata(const native_handle_t* bufferHandle,
+                                    BufferMetadata* outMetadata) = 0;
+
     virtual Error validateBufferSize(const native_handle_t* bufferHandle,
                                      const IMapper::BufferDescriptorInfo& descriptorInfo,
                                      uint32_t stride) = 0;
@@ -51,21 +161,96 @@ public:
     virtual Error getTransportSize(const native_handle_t* bufferHandle, uint32_t* outNumFds,
                                    uint32_t* outNumInts) = 0;
 
+    // Whether lock does nothing with the acquire fence but wait for it.  The
+    // mapper then waits for the fence of the client itself and passes no
+    // fence, instead of handing over a dup of it.
+    virtual bool waitsForAcquireFence() const { return false; }
+
     // lock a buffer
     virtual Error lock(const native_handle_t* bufferHandle, uint64_t cpuUsage,
                        const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
                        void** outData) = 0;
 
+    // Lock a buffer without blocking the caller on the acquire fence.  The
+    // callback runs once the buffer is locked, possibly on another thread.
+    // The caller keeps bufferHandle imported until the callback has run.
+    // By default the lock is done synchronously.
+    virtual void lockAsync(const native_handle_t* bufferHandle, uint64_t cpuUsage,
+                           const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
+                           std::function<void(Error error, void* data)> callback) {
+        void* data = nullptr;
+        Error error = lock(bufferHandle, cpuUsage, accessRegion, std::move(fenceFd), &data);
+        callback(error, data);
+    }
+
+    // Lock a buffer through a CPU mapping kept by the HAL, without the
+    // vendor module.  The acquire fence must have signaled.  Returns nullptr
+    // when the buffer cannot be locked that way, in which case it is locked
+    // with lock instead.  A lock taken here is released with unlockCached,
+    // never with unlock.
+    virtual void* lockCached(const native_handle_t* bufferHandle, uint64_t cpuUsage,
+                             const IMapper::Rect& accessRegion) {
+        return nullptr;
+    }
+
+    // release a lock taken by lockCached
+    virtual void unlockCached(const native_handle_t* bufferHandle) {}
+
     // lock a YCbCr buffer
-    virtual Error lockYCbCr(const native_handle_t* bufferHandle, uint64_t cpuUsage,
-                            const IMapper::Rect& accessRegion, base::unique_fd fenceFd,
-                            YCbCrLayout* outLayout) = 0;
+    virtual Error lockYCbCr(const native_handle_t* bufferHandle, const BufferMetadata& metadata,
+                            uint64_t cpuUsage, const IMapper::Rect& accessRegion,
+                            base::unique_fd fenceFd, YCbCrLayout* outLayout) = 0;
 
     // unlock a buffer
     virtual Error unlock(const native_handle_t* bufferHandle, base::unique_fd* outFenceFd) = 0;
 
+    // lock several buffers.  When one of them fails, the buffers locked so
+    // far are unlocked again and the error is returned.
+    virtual Error lockBatch(std::vector<LockRequest>* requests, std::vector<void*>* outData) {
+        outData->resize(requests->size());
+        for (size_t i = 0; i < requests->size(); i++) {
+            LockRequest& request = (*requests)[i];
+            Error error = lock(request.bufferHandle, request.cpuUsage, request.accessRegion,
+                               std::move(request.fenceFd), &(*outData)[i]);
+            if (error != Error::NONE) {
+                while (i-- > 0) {
+                    base::unique_fd fenceFd;
+                    unlock((*requests)[i].bufferHandle, &fenceFd);
+                }
+                return error;
+            }
+        }
+
+        return Error::NONE;
+    }
+
+    // unlock several buffers.  Every buffer is unlocked even when some of
+    // them fail, in which case the first error is returned.
+    virtual Error unlockBatch(const std::vector<const native_handle_t*>& bufferHandles,
+                              std::vector<base::unique_fd>* outFenceFds) {
+        Error firstError = Error::NONE;
+        outFenceFds->resize(bufferHandles.size());
+        for (size_t i = 0; i < bufferHandles.size(); i++) {
+            Error error = unlock(bufferHandles[i], &(*outFenceFds)[i]);
+            if (error != Error::NONE && firstError == Error::NONE) {
+                firstError = error;
+            }
+        }
+
+        return firstError;
+    }
+
     // check if buffer format is supported
     virtual bool isSupported(const IMapper::BufferDescriptorInfo& descriptorInfo) = 0;
+
+    // check a list of buffer descriptions in one call
+    virtual void isSupportedBatch(const hidl_vec<IMapper::BufferDescriptorInfo>& descriptorInfos,
+                                  hidl_vec<bool>* outSupported) {
+        outSupported->resize(descriptorInfos.size());
+        for (size_t i = 0; i < descriptorInfos.size(); i++) {
+            (*outSupported)[i] = isSupported(descriptorInfos[i]);
+        }
+    }
 };
 
 }  // namespace hal
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace hal {
+
+// MapperStats collects per-operation latency histograms and buffer counters
+// for the whole process.  Every thread updates its own block of counters
+// without any locking; snapshot() and dump() sum the blocks up.
+class MapperStats {
+public:
+    enum class Op : uint32_t {
+        IMPORT,
+        FREE,
+        LOCK,
+        LOCK_YCBCR,
+        UNLOCK,
+        FENCE_WAIT,
+        LOCK_CONVERT,
+        COUNT,
+    };
+
+    enum class Counter : uint32_t {
+        IMPORTED_BUFFERS,
+        LOCKED_BUFFERS,
+        // imported handles cloned into a slab, or with native_handle_clone
+        HANDLE_SLAB_HITS,
+        HANDLE_SLAB_FALLBACKS,
+        // acquire fences of the client that were dup'd for the HAL, or
+        // dropped because they had signaled or were waited for in place
+        ACQUIRE_FENCES_DUPED,
+        ACQUIRE_FENCES_ELIDED,
+        // buffers mapped by the mapping cache, and how many of them were
+        // hinted with MADV_HUGEPAGE.  Whether the exporter really mapped
+        // them with huge pages only shows in the FilePmdMapped and
+        // ShmemPmdMapped fields of /proc/<pid>/smaps.
+        CACHED_MAPPINGS,
+        HUGEPAGE_HINTED_MAPPINGS,
+        // imports that shared the handle of an earlier import
+        IMPORTS_SHARED,
+        // lockYCbCr calls that needed heap storage for the flex planes of
+        // a gralloc1 module; expected to stay at zero for the formats we
+        // ship
+        FLEX_PLANE_HEAP_ALLOCATIONS,
+        COUNT,
+    };
+
+    static constexpr size_t kOpCount = static_cast<size_t>(Op::COUNT);
+    static constexpr size_t kCounterCount = static_cast<size_t>(Counter::COUNT);
+
+    // bucket 0 holds latencies below 1us, bucket i holds [2^(i-1), 2^i) us,
+    // and the last bucket everything above
+    static constexpr size_t kHistogramBuckets = 24;
+
+    struct OpSnapshot {
+        uint64_t count = 0;
+        uint64_t totalNs = 0;
+        uint64_t maxNs = 0;
+        std::array<uint64_t, kHistogramBuckets> histogram = {};
+
+        // upper bound in us of the bucket holding the given percentile
+        uint64_t getPercentileUs(uint32_t percentile) const {
+            const uint64_t target = (count * percentile + 99) / 100;
+            uint64_t seen = 0;
+            for (size_t i = 0; i < kHistogramBuckets; i++) {
+                seen += histogram[i];
+                if (seen >= target && seen) {
+                    return uint64_t(1) << i;
+                }
+            }
+            return 0;
+        }
+    };
+
+    struct Snapshot {
+        std::array<OpSnapshot, kOpCount> ops;
+        std::array<int64_t, kCounterCount> counters = {};
+
+        const OpSnapshot& get(Op op) const { return ops[static_cast<size_t>(op)]; }
+        int64_t get(Counter counter) const { return counters[static_cast<size_t>(counter)]; }
+    };
+
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(Op op) : mOp(op), mStart(std::chrono::steady_clock::now()) {}
+
+        ~ScopedTimer() {
+            const auto elapsed = std::chrono::steady_clock::now() - mStart;
+            record(mOp, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+
+    private:
+        const Op mOp;
+        const std::chrono::steady_clock::time_point mStart;
+    };
+
+    static void record(Op op, uint64_t ns) {
+        ThreadBlock& block = getThreadBlock();
+        const size_t index = static_cast<size_t>(op);
+        increment(&block.count[index], 1);
+        increment(&block.totalNs[index], ns);
+        if (ns > block.maxNs[index].load(std::memory_order_relaxed)) {
+            block.maxNs[index].store(ns, std::memory_order_relaxed);
+        }
+        increment(&block.histogram[index][getBucket(ns)], 1);
+    }
+
+    static void add(Counter counter, int64_t delta) {
+        increment(&getThreadBlock().counters[static_cast<size_t>(counter)], delta);
+    }
+
+    static Snapshot snapshot() {
+        Registry& registry = getRegistry();
+
+        Snapshot snapshot;
+        std::lock_guard<std::mutex> lock(registry.mutex);
+        accumulate(registry.retired, &snapshot);
+        for (const ThreadBlock* block : registry.blocks) {
+            accumulate(*block, &snapshot);
+        }
+        return snapshot;
+    }
+
+    static std::string dump() {
+        static const char* const kOpNames[kOpCount] = {
+            "import", "free", "lock", "lockYCbCr", "unlock", "fenceWait", "lockConvert",
+        };
+
+        const Snapshot stats = snapshot();
+
+        std::string result;
+        char line[160];
+        snprintf(line, sizeof(line), "imported buffers: %" PRId64 "\nlocked buffers: %" PRId64 "\n",
+                 stats.get(Counter::IMPORTED_BUFFERS), stats.get(Counter::LOCKED_BUFFERS));
+        result += line;
+        snprintf(line, sizeof(line), "handle slab hits: %" PRId64 ", fallbacks: %" PRId64 "\n",
+                 stats.get(Counter::HANDLE_SLAB_HITS), stats.get(Counter::HANDLE_SLAB_FALLBACKS));
+        result += line;
+        snprintf(line, sizeof(line), "shared imports: %" PRId64 "\n",
+                 stats.get(Counter::IMPORTS_SHARED));
+        result += line;
+        snprintf(line, sizeof(line), "flex plane heap allocations: %" PRId64 "\n",
+                 stats.get(Counter::FLEX_PLANE_HEAP_ALLOCATIONS));
+        result += line;
+        snprintf(line, sizeof(line), "acquire fences dup'd: %" PRId64 ", elided: %" PRId64 "\n",
+                 stats.get(Counter::ACQUIRE_FENCES_DUPED),
+                 stats.get(Counter::ACQUIRE_FENCES_ELIDED));
+        result += line;
+        const int64_t mappings = stats.get(Counter::CACHED_MAPPINGS);
+        const int64_t hintedMappings = stats.get(Counter::HUGEPAGE_HINTED_MAPPINGS);
+        snprintf(line, sizeof(line), "cached mappings: %" PRId64 ", hugepage hinted: %" PRId64
+                 " (%" PRId64 "%%)\n", mappings, hintedMappings,
+                 mappings ? hintedMappings * 100 / mappings : 0);
+        result += line;
+
+        snprintf(line, sizeof(line), "%-11s %10s %10s %10s %10s %10s\n", "op", "count", "avg(us)",
+                 "p50(us)", "p99(us)", "max(us)");
+        result += line;
+        for (size_t i = 0; i < kOpCount; i++) {
+            const OpSnapshot& op = stats.ops[i];
+            const uint64_t avgUs = op.count ? op.totalNs / op.count / 1000 : 0;
+            snprintf(line, sizeof(line),
+                     "%-11s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                     kOpNames[i], op.count, avgUs, op.getPercentileUs(50), op.getPercentileUs(99),
+                     op.maxNs / 1000);
+            result += line;
+        }
+
+        return result;
+    }
+
+private:
+    struct ThreadBlock {
+        std::atomic<uint64_t> count[kOpCount] = {};
+        std::atomic<uint64_t> totalNs[kOpCount] = {};
+        std::atomic<uint64_t> maxNs[kOpCount] = {};
+        std::atomic<uint64_t> histogram[kOpCount][kHistogramBuckets] = {};
+        std::atomic<int64_t> counters[kCounterCount] = {};
+    };
+
+    struct Registry {
+        std::mutex mutex;
+        std::vector<ThreadBlock*> blocks;
+        // counters of threads that have exited
+        ThreadBlock retired;
+    };
+
+    // registers the block of the calling thread, and folds it into the
+    // retired block when the thread exits
+    struct ThreadRegistration {
+        ThreadRegistration() {
+            Registry& registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.blocks.push_back(&block);
+        }
+
+        ~ThreadRegistration() {
+            Registry& registry = getRegistry();
+            std::lock_guard<std::mutex> lock(registry.mutex);
+            registry.blocks.erase(
+                std::find(registry.blocks.begin(), registry.blocks.end(), &block));
+            merge(block, &registry.retired);
+        }
+
+        ThreadBlock block;
+    };
+
+    static Registry& getRegistry() {
+        // leaked, as threads may exit during process termination
+        static Registry* registry = new Registry;
+        return *registry;
+    }
+
+    static ThreadBlock& getThreadBlock() {
+        thread_local ThreadRegistration registration;
+        return registration.block;
+    }
+
+    // only the owning thread writes to a block, so a plain load and store
+    // is enough
+    template <typename T, typename U>
+    static void increment(std::atomic<T>* value, U delta) {
+        value->store(value->load(std::memory_order_relaxed) + static_cast<T>(delta),
+                     std::memory_order_relaxed);
+    }
+
+    static size_t getBucket(uint64_t ns) {
+        const uint64_t us = ns / 1000;
+        if (!us) {
+            return 0;
+        }
+        const size_t bucket = 64 - __builtin_clzll(us);
+        return std::min(bucket, kHistogramBuckets - 1);
+    }
+
+    static void accumulate(const ThreadBlock& block, Snapshot* snapshot) {
+        for (size_t i = 0; i < kOpCount; i++) {
+            OpSnapshot& op = snapshot->ops[i];
+            op.count += block.count[i].load(std::memory_order_relaxed);
+            op.totalNs += block.totalNs[i].load(std::memory_order_relaxed);
+            op.maxNs = std::max(op.maxNs, block.maxNs[i].load(std::memory_order_relaxed));
+            for (size_t j = 0; j < kHistogramBuckets; j++) {
+                op.histogram[j] += block.histogram[i][j].load(std::memory_order_relaxed);
+            }
+        }
+        for (size_t i = 0; i < kCounterCount; i++) {
+            snapshot->counters[i] += block.counters[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    // called with the registry mutex held
+    static void merge(const ThreadBlock& block, ThreadBlock* retired) {
+        for (size_t i = 0; i < kOpCount; i++) {
+            increment(&retired->count[i], block.count[i].load(std::memory_order_relaxed));
+            increment(&retired->totalNs[i], block.totalNs[i].load(std::memory_order_relaxed));
+            retired->maxNs[i].store(std::max(retired->maxNs[i].load(std::memory_order_relaxed),
+                                             block.maxNs[i].load(std::memory_order_relaxed)),
+                                    std::memory_order_relaxed);
+            for (size_t j = 0; j < kHistogramBuckets; j++) {
+                increment(&retired->histogram[i][j],
+                          block.histogram[i][j].load(std::memory_order_relaxed));
+            }
+        }
+        for (size_t i = 0; i < kCounterCount; i++) {
+            increment(&retired->counters[i], block.counters[i].load(std::memory_order_relaxed));
+        }
+    }
+};
+
+}  // namespace hal
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#ifndef LOG_TAG
+#warning "MapperWorkerPool.h included without LOG_TAG"
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <cutils/properties.h>
+#include <log/log.h>
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace hal {
+
+// MapperWorkerPool runs mapper work off the calling thread on a few
+// persistent worker threads, which are started on first use.  The number
+// of workers is ro.vendor.gralloc.mapper.worker_threads, capped at the
+// number of CPUs.  When no worker can be started, post fails and run does
+// all the work on the caller, so that running out of threads never aborts
+// the process.
+class MapperWorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    static MapperWorkerPool& getInstance() {
+        // like GrallocImportedBufferPool, leaked on purpose so that it stays
+        // valid during process termination
+        static MapperWorkerPool* singleton = new MapperWorkerPool;
+        return *singleton;
+    }
+
+    // Run task on a worker.  Returns false, without running it, when there
+    // is no worker.
+    bool post(Task task) {
+        if (!getWorkerCount()) {
+            return false;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTasks.push_back(std::move(task));
+        }
+        mCondition.notify_one();
+        return true;
+    }
+
+    // Run task(0) to task(count - 1), spread over the workers and the
+    // calling thread, and return once all of them have run.
+    void run(size_t count, const std::function<void(size_t)>& task) {
+        struct Batch {
+            std::function<void(size_t)> task;
+            size_t count;
+            std::atomic<size_t> next{0};
+            std::atomic<size_t> done{0};
+            std::mutex mutex;
+            std::condition_variable condition;
+
+            void runAll() {
+                for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+                    task(i);
+                    if (done.fetch_add(1, std::memory_order_acq_rel) + 1 == count) {
+                        std::lock_guard<std::mutex> lock(mutex);
+                        condition.notify_all();
+                    }
+                }
+            }
+        };
+
+        // helpers that start late find nothing left to do, but still hold
+        // on to the batch
+        auto batch = std::make_shared<Batch>();
+        batch->task = task;
+        batch->count = count;
+
+        for (size_t i = 1; i < count && i <= getWorkerCount(); i++) {
+            if (!post([batch]() { batch->runAll(); })) {
+                break;
+            }
+        }
+        batch->runAll();
+
+        std::unique_lock<std::mutex> lock(batch->mutex);
+        batch->condition.wait(lock, [&batch]() {
+            return batch->done.load(std::memory_order_acquire) == batch->count;
+        });
+    }
+
+private:
+    static constexpr uint32_t kMaxWorkers = 8;
+
+    uint32_t getWorkerCount() {
+        std::call_once(mStartFlag, [this]() { start(); });
+        return mWorkerCount;
+    }
+
+    void start() {
+        const uint32_t cpus = std::max(1u, std::thread::hardware_concurrency());
+        const int32_t threads = property_get_int32("ro.vendor.gralloc.mapper.worker_threads", 2);
+        const uint32_t count =
+            std::min({cpus, kMaxWorkers, static_cast<uint32_t>(std::max(threads, 0))});
+
+        for (uint32_t i = 0; i < count; i++) {
+            pthread_t thread;
+            const int error = pthread_create(&thread, nullptr, &MapperWorkerPool::threadMain, this);
+            if (error) {
+                ALOGE("failed to start mapper worker: %s", strerror(error));
+                break;
+            }
+            pthread_detach(thread);
+            mWorkerCount++;
+        }
+    }
+
+    static void* threadMain(void* pool) {
+        static_cast<MapperWorkerPool*>(pool)->threadLoop();
+        return nullptr;
+    }
+
+    void threadLoop() {
+        while (true) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mCondition.wait(lock, [this]() { return !mTasks.empty(); });
+                task = std::move(mTasks.front());
+                mTasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::once_flag mStartFlag;
+    // only written before mStartFlag is set
+    uint32_t mWorkerCount = 0;
+
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::deque<Task> mTasks;
+};
+
+}  // namespace hal
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
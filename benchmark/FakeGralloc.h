@@ -0,0 +1,370 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <hardware/gralloc.h>
+#include <hardware/gralloc1.h>
+#include "../../hwcomposer/img_gralloc_common_public.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace fake {
+
+// Stand-ins for the vendor gralloc0 and gralloc1 modules.  Buffers are
+// unlinked temporary files wrapped in an IMG_native_handle_t, and the
+// modules map them on register/retain like the real ones do, keeping their
+// bookkeeping behind a single global lock.
+
+constexpr int kFakeHandleNumFds = MAX_SUB_ALLOCS;
+constexpr int kFakeHandleNumInts =
+    (sizeof(IMG_native_handle_t) - sizeof(native_handle_t)) / sizeof(int) - kFakeHandleNumFds;
+
+// an unlinked temporary file, as memfd_create is not available everywhere
+inline int createSharedMemory() {
+#ifdef __ANDROID__
+    const char* dir = "/data/local/tmp";
+#else
+    const char* dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+#endif
+    std::string path = std::string(dir) + "/fake-gralloc-XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd >= 0) {
+        unlink(path.c_str());
+    }
+    return fd;
+}
+
+// allocate a raw buffer handle; HAL_PIXEL_FORMAT_NV12 buffers are 12bpp
+inline native_handle_t* fakeAllocateBuffer(uint32_t width, uint32_t height, int32_t format) {
+    static std::atomic<unsigned long long> nextStamp(1);
+
+    const uint32_t bitsPerPixel = format == HAL_PIXEL_FORMAT_NV12 ? 12 : 32;
+    const size_t size = static_cast<size_t>(width) * height * bitsPerPixel / 8;
+
+    int fd = createSharedMemory();
+    if (fd < 0) {
+        return nullptr;
+    }
+    if (ftruncate(fd, size)) {
+        close(fd);
+        return nullptr;
+    }
+
+    native_handle_t* handle = native_handle_create(kFakeHandleNumFds, kFakeHandleNumInts);
+    IMG_native_handle_t* imgHandle = reinterpret_cast<IMG_native_handle_t*>(handle);
+    for (int i = 0; i < kFakeHandleNumFds; i++) {
+        imgHandle->fd[i] = i ? dup(fd) : fd;
+    }
+    imgHandle->ui64Stamp = nextStamp++;
+    imgHandle->iWidth = width;
+    imgHandle->iHeight = height;
+    imgHandle->iFormat = format;
+    imgHandle->uiBpp = bitsPerPixel;
+    // the planes are packed, so their heights and offsets are left unknown
+    for (int i = 0; i < MAX_SUB_ALLOCS; i++) {
+        imgHandle->aiStride[i] = width;
+        imgHandle->aiVStride[i] = 0;
+        imgHandle->aulPlaneOffset[i] = 0;
+    }
+
+    return handle;
+}
+
+inline void fakeFreeBuffer(native_handle_t* handle) {
+    native_handle_close(handle);
+    native_handle_delete(handle);
+}
+
+class FakeBufferRegistry {
+public:
+    static FakeBufferRegistry& getInstance() {
+        static FakeBufferRegistry* registry = new FakeBufferRegistry;
+        return *registry;
+    }
+
+    int add(buffer_handle_t handle) {
+        const IMG_native_handle_t* imgHandle = reinterpret_cast<const IMG_native_handle_t*>(handle);
+        const size_t size = getSize(imgHandle);
+        void* address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, imgHandle->fd[0], 0);
+        if (address == MAP_FAILED) {
+            return -errno;
+        }
+
+        std::lock_guard<std::mutex> lock(mMutex);
+        mMappings[handle] = address;
+        return 0;
+    }
+
+    int remove(buffer_handle_t handle) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mMappings.find(handle);
+        if (it == mMappings.end()) {
+            return -EINVAL;
+        }
+
+        munmap(it->second, getSize(reinterpret_cast<const IMG_native_handle_t*>(handle)));
+        mMappings.erase(it);
+        return 0;
+    }
+
+    void* get(buffer_handle_t handle) {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mMappings.find(handle);
+        return it != mMappings.end() ? it->second : nullptr;
+    }
+
+    static size_t getSize(const IMG_native_handle_t* imgHandle) {
+        return static_cast<size_t>(imgHandle->aiStride[0]) * imgHandle->iHeight *
+               imgHandle->uiBpp / 8;
+    }
+
+    // NV12 plane pointers of a mapped buffer
+    static void getNv12Planes(const IMG_native_handle_t* imgHandle, void* address,
+                              uint8_t** outY, uint8_t** outCb, uint8_t** outCr) {
+        uint8_t* y = static_cast<uint8_t*>(address);
+        *outY = y;
+        *outCb = y + imgHandle->aiStride[0] * imgHandle->iHeight;
+        *outCr = *outCb + 1;
+    }
+
+private:
+    std::mutex mMutex;
+    std::unordered_map<buffer_handle_t, void*> mMappings;
+};
+
+namespace gralloc0 {
+
+inline int registerBuffer(const gralloc_module_t*, buffer_handle_t handle) {
+    return FakeBufferRegistry::getInstance().add(handle);
+}
+
+inline int unregisterBuffer(const gralloc_module_t*, buffer_handle_t handle) {
+    return FakeBufferRegistry::getInstance().remove(handle);
+}
+
+inline int lock(const gralloc_module_t*, buffer_handle_t handle, int, int, int, int, int,
+                void** outAddress) {
+    *outAddress = FakeBufferRegistry::getInstance().get(handle);
+    return *outAddress ? 0 : -EINVAL;
+}
+
+inline int unlock(const gralloc_module_t*, buffer_handle_t handle) {
+    return FakeBufferRegistry::getInstance().get(handle) ? 0 : -EINVAL;
+}
+
+inline int lockYCbCr(const gralloc_module_t*, buffer_handle_t handle, int, int, int, int, int,
+                     android_ycbcr* outYCbCr) {
+    const IMG_native_handle_t* imgHandle = reinterpret_cast<const IMG_native_handle_t*>(handle);
+    void* address = FakeBufferRegistry::getInstance().get(handle);
+    if (!address || imgHandle->iFormat != HAL_PIXEL_FORMAT_NV12) {
+        return -EINVAL;
+    }
+
+    uint8_t* y;
+    uint8_t* cb;
+    uint8_t* cr;
+    FakeBufferRegistry::getNv12Planes(imgHandle, address, &y, &cb, &cr);
+    outYCbCr->y = y;
+    outYCbCr->cb = cb;
+    outYCbCr->cr = cr;
+    outYCbCr->ystride = imgHandle->aiStride[0];
+    outYCbCr->cstride = imgHandle->aiStride[0];
+    outYCbCr->chroma_step = 2;
+    return 0;
+}
+
+// a gralloc 0.2 module, i.e. without the async lock entry points
+inline const hw_module_t* getModule() {
+    static gralloc_module_t module = [] {
+        gralloc_module_t m = {};
+        m.common.tag = HARDWARE_MODULE_TAG;
+        m.common.module_api_version = HARDWARE_MODULE_API_VERSION(0, 2);
+        m.common.id = GRALLOC_HARDWARE_MODULE_ID;
+        m.common.name = "fake gralloc0";
+        m.registerBuffer = registerBuffer;
+        m.unregisterBuffer = unregisterBuffer;
+        m.lock = lock;
+        m.unlock = unlock;
+        m.lock_ycbcr = lockYCbCr;
+        return m;
+    }();
+    return &module.common;
+}
+
+}  // namespace gralloc0
+
+namespace gralloc1 {
+
+inline int32_t retain(gralloc1_device_t*, buffer_handle_t handle) {
+    return FakeBufferRegistry::getInstance().add(handle) ? GRALLOC1_ERROR_BAD_HANDLE
+                                                         : GRALLOC1_ERROR_NONE;
+}
+
+inline int32_t release(gralloc1_device_t*, buffer_handle_t handle) {
+    return FakeBufferRegistry::getInstance().remove(handle) ? GRALLOC1_ERROR_BAD_HANDLE
+                                                            : GRALLOC1_ERROR_NONE;
+}
+
+inline int32_t getNumFlexPlanes(gralloc1_device_t*, buffer_handle_t handle,
+                                uint32_t* outNumPlanes) {
+    const IMG_native_handle_t* imgHandle = reinterpret_cast<const IMG_native_handle_t*>(handle);
+    if (imgHandle->iFormat != HAL_PIXEL_FORMAT_NV12) {
+        return GRALLOC1_ERROR_UNSUPPORTED;
+    }
+    *outNumPlanes = 3;
+    return GRALLOC1_ERROR_NONE;
+}
+
+inline int32_t lock(gralloc1_device_t*, buffer_handle_t handle, uint64_t, uint64_t,
+                    const gralloc1_rect_t*, void** outData, int32_t acquireFence) {
+    if (acquireFence >= 0) {
+        close(acquireFence);
+    }
+    *outData = FakeBufferRegistry::getInstance().get(handle);
+    return *outData ? GRALLOC1_ERROR_NONE : GRALLOC1_ERROR_BAD_HANDLE;
+}
+
+inline int32_t lockFlex(gralloc1_device_t*, buffer_handle_t handle, uint64_t, uint64_t,
+                        const gralloc1_rect_t*, android_flex_layout* outFlex,
+                        int32_t acquireFence) {
+    if (acquireFence >= 0) {
+        close(acquireFence);
+    }
+
+    const IMG_native_handle_t* imgHandle = reinterpret_cast<const IMG_native_handle_t*>(handle);
+    void* address = FakeBufferRegistry::getInstance().get(handle);
+    if (!address || imgHandle->iFormat != HAL_PIXEL_FORMAT_NV12 || outFlex->num_planes < 3) {
+        return GRALLOC1_ERROR_BAD_HANDLE;
+    }
+
+    uint8_t* planes[3];
+    FakeBufferRegistry::getNv12Planes(imgHandle, address, &planes[0], &planes[1], &planes[2]);
+    const android_flex_component_t components[3] = {FLEX_COMPONENT_Y, FLEX_COMPONENT_Cb,
+                                                    FLEX_COMPONENT_Cr};
+    outFlex->format = FLEX_FORMAT_YCbCr;
+    outFlex->num_planes = 3;
+    for (int i = 0; i < 3; i++) {
+        android_flex_plane_t& plane = outFlex->planes[i];
+        plane.top_left = planes[i];
+        plane.component = components[i];
+        plane.bits_per_component = 8;
+        plane.bits_used = 8;
+        plane.h_increment = i ? 2 : 1;
+        plane.v_increment = imgHandle->aiStride[0];
+        plane.h_subsampling = i ? 2 : 1;
+        plane.v_subsampling = i ? 2 : 1;
+    }
+    return GRALLOC1_ERROR_NONE;
+}
+
+inline int32_t unlock(gralloc1_device_t*, buffer_handle_t handle, int32_t* outReleaseFence) {
+    *outReleaseFence = -1;
+    return FakeBufferRegistry::getInstance().get(handle) ? GRALLOC1_ERROR_NONE
+                                                         : GRALLOC1_ERROR_BAD_HANDLE;
+}
+
+inline int32_t validateBufferSize(gralloc1_device_t*, buffer_handle_t,
+                                  const gralloc1_buffer_descriptor_info_t*, uint32_t) {
+    return GRALLOC1_ERROR_NONE;
+}
+
+inline int32_t getTransportSize(gralloc1_device_t*, buffer_handle_t handle, uint32_t* outNumFds,
+                                uint32_t* outNumInts) {
+    *outNumFds = handle->numFds;
+    *outNumInts = handle->numInts;
+    return GRALLOC1_ERROR_NONE;
+}
+
+inline void getCapabilities(gralloc1_device_t*, uint32_t* outCount, int32_t*) {
+    *outCount = 0;
+}
+
+inline gralloc1_function_pointer_t getFunction(gralloc1_device_t*, int32_t descriptor) {
+    switch (descriptor) {
+        case GRALLOC1_FUNCTION_RETAIN:
+            return reinterpret_cast<gralloc1_function_pointer_t>(retain);
+        case GRALLOC1_FUNCTION_RELEASE:
+            return reinterpret_cast<gralloc1_function_pointer_t>(release);
+        case GRALLOC1_FUNCTION_GET_NUM_FLEX_PLANES:
+            return reinterpret_cast<gralloc1_function_pointer_t>(getNumFlexPlanes);
+        case GRALLOC1_FUNCTION_LOCK:
+            return reinterpret_cast<gralloc1_function_pointer_t>(lock);
+        case GRALLOC1_FUNCTION_LOCK_FLEX:
+            return reinterpret_cast<gralloc1_function_pointer_t>(lockFlex);
+        case GRALLOC1_FUNCTION_UNLOCK:
+            return reinterpret_cast<gralloc1_function_pointer_t>(unlock);
+        case GRALLOC1_FUNCTION_VALIDATE_BUFFER_SIZE:
+            return reinterpret_cast<gralloc1_function_pointer_t>(validateBufferSize);
+        case GRALLOC1_FUNCTION_GET_TRANSPORT_SIZE:
+            return reinterpret_cast<gralloc1_function_pointer_t>(getTransportSize);
+        default:
+            return nullptr;
+    }
+}
+
+inline int closeDevice(hw_device_t*) {
+    return 0;
+}
+
+inline int openDevice(const hw_module_t* module, const char*, hw_device_t** outDevice) {
+    static gralloc1_device_t device = {};
+    device.common.tag = HARDWARE_DEVICE_TAG;
+    device.common.module = const_cast<hw_module_t*>(module);
+    device.common.close = closeDevice;
+    device.getCapabilities = getCapabilities;
+    device.getFunction = getFunction;
+    *outDevice = &device.common;
+    return 0;
+}
+
+inline const hw_module_t* getModule() {
+    static hw_module_methods_t methods = {openDevice};
+    static hw_module_t module = [] {
+        hw_module_t m = {};
+        m.tag = HARDWARE_MODULE_TAG;
+        m.module_api_version = HARDWARE_MODULE_API_VERSION(1, 0);
+        m.id = GRALLOC_HARDWARE_MODULE_ID;
+        m.name = "fake gralloc1";
+        m.methods = &methods;
+        return m;
+    }();
+    return &module;
+}
+
+}  // namespace gralloc1
+
+}  // namespace fake
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,366 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "android.hardware.graphics.mapper@3.0-impl_benchmark"
+
+#include <poll.h>
+
+#include <random>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+#include "../GrallocLoader.h"
+#include "FakeGralloc.h"
+
+namespace android {
+namespace hardware {
+namespace graphics {
+namespace mapper {
+namespace V3_0 {
+namespace renesas {
+namespace fake {
+namespace {
+
+using hal::MapperStats;
+using passthrough::GrallocLoader;
+
+constexpr uint32_t kWidth = 1920;
+constexpr uint32_t kHeight = 1080;
+
+enum ModuleVersion : int64_t {
+    GRALLOC0 = 0,
+    GRALLOC1 = 1,
+};
+
+IMapper* getMapper(int64_t version) {
+    static IMapper* mappers[2] = {
+        GrallocLoader::createMapper(gralloc0::getModule()),
+        GrallocLoader::createMapper(gralloc1::getModule()),
+    };
+    return mappers[version];
+}
+
+void* importBuffer(IMapper* mapper, const native_handle_t* rawHandle) {
+    void* buffer = nullptr;
+    mapper->importBuffer(hidl_handle(rawHandle), [&](Error error, void* importedBuffer) {
+        if (error == Error::NONE) {
+            buffer = importedBuffer;
+        }
+    });
+    return buffer;
+}
+
+bool unlockBuffer(IMapper* mapper, void* buffer) {
+    Error unlockError = Error::NONE;
+    mapper->unlock(buffer, [&unlockError](Error error, const hidl_handle&) {
+        unlockError = error;
+    });
+    return unlockError == Error::NONE;
+}
+
+// Buffers imported and owned by one benchmark thread.  Extra buffers can be
+// imported to grow the imported buffer pool to a given size.
+class ImportedBuffers {
+public:
+    ImportedBuffers(IMapper* mapper, size_t count, int32_t format) : mMapper(mapper) {
+        for (size_t i = 0; i < count; i++) {
+            native_handle_t* rawHandle = fakeAllocateBuffer(kWidth, kHeight, format);
+            mRawHandles.push_back(rawHandle);
+            mBuffers.push_back(importBuffer(mapper, rawHandle));
+        }
+    }
+
+    ~ImportedBuffers() {
+        for (void* buffer : mBuffers) {
+            mMapper->freeBuffer(buffer);
+        }
+        for (native_handle_t* rawHandle : mRawHandles) {
+            fakeFreeBuffer(rawHandle);
+        }
+    }
+
+    void* get(size_t index) const { return mBuffers[index % mBuffers.size()]; }
+
+    bool ok() const {
+        for (void* buffer : mBuffers) {
+            if (!buffer) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    IMapper* const mMapper;
+    std::vector<native_handle_t*> mRawHandles;
+    std::vector<void*> mBuffers;
+};
+
+// Report the p50/p99 of an operation over the benchmark run.  The
+// histograms are process wide, so with several threads the numbers cover
+// all of them.
+class TailLatency {
+public:
+    explicit TailLatency(MapperStats::Op op) : mOp(op), mStart(MapperStats::snapshot()) {}
+
+    void report(::benchmark::State& state) const {
+        const MapperStats::OpSnapshot& start = mStart.get(mOp);
+        MapperStats::OpSnapshot delta = MapperStats::snapshot().get(mOp);
+        delta.count -= start.count;
+        for (size_t i = 0; i < MapperStats::kHistogramBuckets; i++) {
+            delta.histogram[i] -= start.histogram[i];
+        }
+        // every thread reports the same process wide numbers
+        state.counters["p50_us"] = ::benchmark::Counter(delta.getPercentileUs(50),
+                                                        ::benchmark::Counter::kAvgThreads);
+        state.counters["p99_us"] = ::benchmark::Counter(delta.getPercentileUs(99),
+                                                        ::benchmark::Counter::kAvgThreads);
+    }
+
+private:
+    const MapperStats::Op mOp;
+    const MapperStats::Snapshot mStart;
+};
+
+// args: module version, number of buffers already imported by each thread
+void BM_ImportFree(::benchmark::State& state) {
+    IMapper* mapper = getMapper(state.range(0));
+    ImportedBuffers pool(mapper, state.range(1), HAL_PIXEL_FORMAT_RGBA_8888);
+    native_handle_t* rawHandle = fakeAllocateBuffer(kWidth, kHeight, HAL_PIXEL_FORMAT_RGBA_8888);
+    if (!pool.ok() || !rawHandle) {
+        state.SkipWithError("failed to import buffers");
+        return;
+    }
+
+    TailLatency latency(MapperStats::Op::IMPORT);
+    for (auto _ : state) {
+        void* buffer = importBuffer(mapper, rawHandle);
+        if (!buffer) {
+            state.SkipWithError("importBuffer failed");
+            break;
+        }
+        if (mapper->freeBuffer(buffer) != Error::NONE) {
+            state.SkipWithError("freeBuffer failed");
+            break;
+        }
+    }
+    latency.report(state);
+
+    fakeFreeBuffer(rawHandle);
+}
+
+// args: module version, number of buffers imported by each thread
+void BM_LockUnlock(::benchmark::State& state) {
+    IMapper* mapper = getMapper(state.range(0));
+    ImportedBuffers buffers(mapper, state.range(1), HAL_PIXEL_FORMAT_RGBA_8888);
+    if (!buffers.ok()) {
+        state.SkipWithError("failed to import buffers");
+        return;
+    }
+
+    const IMapper::Rect region = {0, 0, kWidth, kHeight};
+    const uint64_t usage = static_cast<uint64_t>(common::V1_2::BufferUsage::CPU_READ_OFTEN);
+
+    TailLatency latency(MapperStats::Op::LOCK);
+    size_t index = 0;
+    for (auto _ : state) {
+        void* buffer = buffers.get(index++);
+        Error lockError = Error::NONE;
+        mapper->lock(buffer, usage, region, hidl_handle(),
+                     [&lockError](Error error, void* data, int32_t, int32_t) {
+                         lockError = error;
+                         ::benchmark::DoNotOptimize(data);
+                     });
+        if (lockError != Error::NONE) {
+            state.SkipWithError("lock failed");
+            break;
+        }
+        if (!unlockBuffer(mapper, buffer)) {
+            state.SkipWithError("unlock failed");
+            break;
+        }
+    }
+    latency.report(state);
+}
+
+// args: module version, number of buffers imported by each thread
+void BM_LockYCbCrUnlock(::benchmark::State& state) {
+    IMapper* mapper = getMapper(state.range(0));
+    ImportedBuffers buffers(mapper, state.range(1), HAL_PIXEL_FORMAT_NV12);
+    if (!buffers.ok()) {
+        state.SkipWithError("failed to import buffers");
+        return;
+    }
+
+    const IMapper::Rect region = {0, 0, kWidth, kHeight};
+    const uint64_t usage = static_cast<uint64_t>(common::V1_2::BufferUsage::CPU_READ_OFTEN);
+
+    TailLatency latency(MapperStats::Op::LOCK_YCBCR);
+    size_t index = 0;
+    for (auto _ : state) {
+        void* buffer = buffers.get(index++);
+        Error lockError = Error::NONE;
+        mapper->lockYCbCr(buffer, usage, region, hidl_handle(),
+                          [&lockError](Error error, const YCbCrLayout& layout) {
+                              lockError = error;
+                              ::benchmark::DoNotOptimize(layout.y);
+                          });
+        if (lockError != Error::NONE) {
+            state.SkipWithError("lockYCbCr failed");
+            break;
+        }
+        if (!unlockBuffer(mapper, buffer)) {
+            state.SkipWithError("unlock failed");
+            break;
+        }
+    }
+    latency.report(state);
+
+    // the planes of every format we ship fit in the inline flex storage
+    if (!state.error_occurred() &&
+        MapperStats::snapshot().get(MapperStats::Counter::FLEX_PLANE_HEAP_ALLOCATIONS)) {
+        state.SkipWithError("lockYCbCr allocated flex planes on the heap");
+    }
+}
+
+// Convert random NV12, NV21, YV12 and UYVY frames with the vector kernels
+// and with the scalar reference, over a region with unaligned edges, and
+// compare the results byte for byte.
+bool vectorMatchesScalar() {
+    std::vector<uint8_t> src(kWidth * kHeight * 2);
+    std::mt19937 random(kWidth);
+    for (uint8_t& byte : src) {
+        byte = static_cast<uint8_t>(random());
+    }
+
+    const IMapper::Rect region = {3, 1, kWidth - 8, kHeight - 2};
+    std::vector<uint8_t> vector(kWidth * kHeight * 4);
+    std::vector<uint8_t> scalar(kWidth * kHeight * 4);
+
+    uint8_t* const chroma = src.data() + kWidth * kHeight;
+    YCbCrLayout layouts[3] = {};
+    for (YCbCrLayout& layout : layouts) {
+        layout.y = src.data();
+        layout.yStride = kWidth;
+    }
+    // NV12 and NV21 share the interleaved plane
+    layouts[0].cb = chroma;
+    layouts[0].cr = chroma + 1;
+    layouts[0].cStride = kWidth;
+    layouts[0].chromaStep = 2;
+    layouts[1].cb = chroma + 1;
+    layouts[1].cr = chroma;
+    layouts[1].cStride = kWidth;
+    layouts[1].chromaStep = 2;
+    layouts[2].cr = chroma;
+    layouts[2].cb = chroma + kWidth / 2 * kHeight / 2;
+    layouts[2].cStride = kWidth / 2;
+    layouts[2].chromaStep = 1;
+
+    for (const YCbCrLayout& layout : layouts) {
+        hal::convertYCbCrToRgba<true>(layout, region, vector.data(), kWidth * 4);
+        hal::convertYCbCrToRgba<false>(layout, region, scalar.data(), kWidth * 4);
+        if (vector != scalar) {
+            return false;
+        }
+    }
+
+    hal::convertUyvyToRgba<true>(src.data(), kWidth * 2, region, vector.data(), kWidth * 4);
+    hal::convertUyvyToRgba<false>(src.data(), kWidth * 2, region, scalar.data(), kWidth * 4);
+    return vector == scalar;
+}
+
+// args: whether the vector kernels are used
+void BM_ConvertNv12ToRgba(::benchmark::State& state) {
+    if (state.range(0) && !vectorMatchesScalar()) {
+        state.SkipWithError("vector conversion differs from the scalar reference");
+        return;
+    }
+
+    std::vector<uint8_t> nv12(kWidth * kHeight * 3 / 2, 0x80);
+    std::vector<uint8_t> rgba(kWidth * kHeight * 4);
+
+    YCbCrLayout layout{};
+    layout.y = nv12.data();
+    layout.cb = nv12.data() + kWidth * kHeight;
+    layout.cr = nv12.data() + kWidth * kHeight + 1;
+    layout.yStride = kWidth;
+    layout.cStride = kWidth;
+    layout.chromaStep = 2;
+
+    const IMapper::Rect region = {0, 0, kWidth, kHeight};
+    for (auto _ : state) {
+        if (state.range(0)) {
+            hal::convertYCbCrToRgba<true>(layout, region, rgba.data(), kWidth * 4);
+        } else {
+            hal::convertYCbCrToRgba<false>(layout, region, rgba.data(), kWidth * 4);
+        }
+        ::benchmark::DoNotOptimize(rgba.data());
+    }
+    state.SetBytesProcessed(state.iterations() * rgba.size());
+    state.SetLabel(state.range(0) ? hal::kBufferConvertIsa : "scalar");
+}
+
+// args: whether BufferCopyEngine copies the frame, or a plain memcpy loop
+void BM_CopyFrame(::benchmark::State& state) {
+    const size_t rowBytes = kWidth * 4;
+    std::vector<uint8_t> src(rowBytes * kHeight, 0x80);
+    std::vector<uint8_t> dst(rowBytes * kHeight);
+
+    for (auto _ : state) {
+        if (state.range(0)) {
+            base::unique_fd completionFd = hal::BufferCopyEngine::getInstance().copy(
+                src.data(), rowBytes, dst.data(), rowBytes, rowBytes, kHeight, nullptr);
+            struct pollfd fds = {completionFd, POLLIN, 0};
+            poll(&fds, 1, -1);
+        } else {
+            for (uint32_t row = 0; row < kHeight; row++) {
+                memcpy(&dst[row * rowBytes], &src[row * rowBytes], rowBytes);
+            }
+        }
+        ::benchmark::DoNotOptimize(dst.data());
+    }
+    state.SetBytesProcessed(state.iterations() * dst.size());
+}
+
+void moduleAndPoolSizes(::benchmark::internal::Benchmark* benchmark) {
+    benchmark->ArgNames({"gralloc", "buffers"});
+    for (int64_t version : {GRALLOC0, GRALLOC1}) {
+        for (int64_t buffers : {1, 4, 64}) {
+            benchmark->Args({version, buffers});
+        }
+    }
+    benchmark->ThreadRange(1, 8);
+    benchmark->UseRealTime();
+}
+
+BENCHMARK(BM_ImportFree)->Apply(moduleAndPoolSizes);
+BENCHMARK(BM_LockUnlock)->Apply(moduleAndPoolSizes);
+BENCHMARK(BM_LockYCbCrUnlock)->Apply(moduleAndPoolSizes);
+BENCHMARK(BM_ConvertNv12ToRgba)->ArgName("vectorize")->Arg(0)->Arg(1);
+BENCHMARK(BM_CopyFrame)->ArgName("parallel")->Arg(0)->Arg(1)->UseRealTime();
+
+}  // namespace
+}  // namespace fake
+}  // namespace renesas
+}  // namespace V3_0
+}  // namespace mapper
+}  // namespace graphics
+}  // namespace hardware
+}  // namespace android
+
+BENCHMARK_MAIN();
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host replacements for libsync and libhardware.  The benchmark hands its
+// fake gralloc modules to GrallocLoader directly and never waits on real
+// sync fences.
+
+#include <errno.h>
+#include <poll.h>
+
+#include <hardware/hardware.h>
+#include <sync/sync.h>
+
+extern "C" int sync_wait(int fd, int timeout) {
+    struct pollfd fds = {fd, POLLIN, 0};
+    int ret;
+    do {
+        ret = poll(&fds, 1, timeout);
+    } while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+    if (ret == 0) {
+        errno = ETIME;
+        return -1;
+    }
+    return ret > 0 ? 0 : -1;
+}
+
+extern "C" int sync_merge(const char* /*name*/, int /*fd1*/, int /*fd2*/) {
+    errno = ENOSYS;
+    return -1;
+}
+
+extern "C" int hw_get_module(const char* /*id*/, const struct hw_module_t** /*module*/) {
+    return -ENOENT;
+}
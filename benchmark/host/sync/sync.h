@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2019 GlobalLogic
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+// libsync is not available on the host; HostShims.cpp provides the subset
+// of it the mapper uses.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int sync_wait(int fd, int timeout);
+int sync_merge(const char* name, int fd1, int fd2);
+
+#ifdef __cplusplus
+}
+#endif